@@ -0,0 +1,151 @@
+#include "batch_scheduler.h"
+
+#include <algorithm>
+
+BatchScheduler::BatchScheduler(BatchBackend backend, const BatchOptions& options)
+: backend_(std::move(backend)), options_(options) {
+    if (options_.max_batch == 0) options_.max_batch = 1;
+    std::sort(options_.lengths.begin(), options_.lengths.end());
+    dispatcher_ = std::thread([this]() { dispatch(); });
+}
+
+BatchScheduler::~BatchScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    queued_.notify_one();
+    dispatcher_.join();
+}
+
+std::future<std::vector<float>> BatchScheduler::submit(std::vector<int64_t> input_ids,
+                                                       std::vector<int64_t> attention_mask) {
+    Request request;
+    std::future<std::vector<float>> result = request.result.get_future();
+    if (input_ids.empty() || input_ids.size() != attention_mask.size()) {
+        request.result.set_value({});
+        return result;
+    }
+    request.input_ids = std::move(input_ids);
+    request.attention_mask = std::move(attention_mask);
+    request.queued = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(request));
+    }
+    queued_.notify_one();
+    return result;
+}
+
+BatchStats BatchScheduler::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+size_t BatchScheduler::padded(size_t length) const {
+    auto it = std::lower_bound(options_.lengths.begin(), options_.lengths.end(), length);
+    return it == options_.lengths.end() ? length : *it;
+}
+
+size_t BatchScheduler::batchable(size_t* length, bool* full) const {
+    size_t count = 0;
+    *length = 0;
+    *full = false;
+    for (const auto& request : queue_) {
+        size_t longest = padded(std::max(*length, request.input_ids.size()));
+        // A sequence over the budget on its own still runs, alone
+        if (count > 0 && (count + 1) * longest > options_.token_budget) {
+            *full = true;
+            break;
+        }
+        count++;
+        *length = longest;
+        if (count == options_.max_batch) {
+            *full = true;
+            break;
+        }
+    }
+    return count;
+}
+
+void BatchScheduler::dispatch() {
+    std::vector<Request> batch;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        queued_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) return;  // stopping
+
+        // Wait for the batch to fill up or for its oldest request to time out
+        auto deadline = queue_.front().queued + options_.max_delay;
+        size_t length = 0;
+        bool full = false;
+        size_t count = batchable(&length, &full);
+        while (!full && !stopping_ && queued_.wait_until(lock, deadline) == std::cv_status::no_timeout) {
+            count = batchable(&length, &full);
+        }
+        count = batchable(&length, &full);
+
+        batch.clear();
+        for (size_t i = 0; i < count; ++i) {
+            batch.push_back(std::move(queue_.front()));
+            queue_.pop_front();
+        }
+        lock.unlock();
+        runBatch(batch, length, full);
+        lock.lock();
+    }
+}
+
+void BatchScheduler::runBatch(std::vector<Request>& batch, size_t length, bool full) {
+    const int64_t rows = static_cast<int64_t>(batch.size());
+    BatchBuffers buffers;
+    bool ok = false;
+    uint64_t tokens = 0;
+    // A throwing backend fails the batch; it must not take the dispatcher
+    // down with every caller still waiting on it
+    try {
+        ok = backend_.prepare(rows, static_cast<int64_t>(length), buffers);
+        if (ok) {
+            // Pad every row to the batch length
+            for (size_t r = 0; r < batch.size(); ++r) {
+                const Request& request = batch[r];
+                int64_t* ids = buffers.input_ids + r * length;
+                int64_t* mask = buffers.attention_mask + r * length;
+                size_t n = request.input_ids.size();
+                std::copy(request.input_ids.begin(), request.input_ids.end(), ids);
+                std::copy(request.attention_mask.begin(), request.attention_mask.end(), mask);
+                std::fill(ids + n, ids + length, 0);
+                std::fill(mask + n, mask + length, 0);
+                tokens += n;
+            }
+            ok = backend_.run();
+        }
+    } catch (...) {
+        ok = false;
+    }
+
+    // Counted before any caller is woken, so stats() covers every answer
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.requests += batch.size();
+        stats_.batches++;
+        stats_.tokens += tokens;
+        stats_.padded_tokens += static_cast<uint64_t>(rows) * length;
+        if (full) stats_.full++;
+        if (!ok) stats_.failed += batch.size();
+    }
+
+    const size_t labels = static_cast<size_t>(backend_.labels);
+    for (size_t r = 0; r < batch.size(); ++r) {
+        std::vector<float> logits;
+        if (ok) {
+            try {
+                const float* row = buffers.logits + r * labels;
+                logits.assign(row, row + labels);
+            } catch (...) {
+                logits.clear();
+            }
+        }
+        batch[r].result.set_value(std::move(logits));
+    }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Dynamic batching in front of a single session.
+//
+// Each request is one tokenized sequence. Callers submit requests from any
+// thread and get a future for their logits. A dispatcher thread collects
+// queued requests into one padded [batch, length] input:
+// - length is the longest sequence in the batch, rounded up to the next of
+//   `lengths`, so the session only ever sees a handful of shapes;
+// - shorter rows are filled with token 0 and a 0 attention mask.
+// It runs the batch once and hands each row's logits back to its caller.
+//
+// A batch is closed when any of these happens:
+// - it holds `max_batch` requests;
+// - one more request would push batch * length over `token_budget`;
+// - its oldest request has waited `max_delay`.
+// A lone request is therefore delayed by at most `max_delay`. Under load the
+// per-run overhead is paid once per batch instead of once per request.
+
+struct BatchOptions {
+    size_t max_batch = 8;
+    std::chrono::microseconds max_delay{2000};
+    size_t token_budget = 8192;  // padded tokens per batch, batch * length
+    // Batch lengths. A batch longer than the last runs at its own
+    // length; empty: every batch runs at its own length.
+    std::vector<size_t> lengths = {16, 32, 64, 128, 256, 512};
+};
+
+// Where the scheduler writes a batch and reads its results.
+struct BatchBuffers {
+    int64_t* input_ids = nullptr;       // [batch, length]
+    int64_t* attention_mask = nullptr;  // [batch, length]
+    const float* logits = nullptr;      // [batch, labels], valid after run()
+};
+
+// The session behind the scheduler. Both calls come from the dispatcher
+// thread only.
+struct BatchBackend {
+    int64_t labels = 0;
+    // Buffers for a [batch, length] run.
+    std::function<bool(int64_t batch, int64_t length, BatchBuffers& buffers)> prepare;
+    // Run on the buffers last prepared.
+    std::function<bool()> run;
+};
+
+struct BatchStats {
+    size_t requests = 0;
+    size_t batches = 0;
+    size_t failed = 0;           // requests whose batch failed to run
+    uint64_t tokens = 0;         // real tokens
+    uint64_t padded_tokens = 0;  // batch * length summed over batches
+    size_t full = 0;             // batches closed by max_batch or token_budget
+};
+
+class BatchScheduler {
+public:
+    BatchScheduler(BatchBackend backend, const BatchOptions& options);
+    ~BatchScheduler();  // runs what is queued, then stops
+
+    BatchScheduler(const BatchScheduler&) = delete;
+    BatchScheduler& operator=(const BatchScheduler&) = delete;
+
+    // Queue one sequence. The future holds its `labels` logits, or is empty
+    // if its batch failed to run.
+    std::future<std::vector<float>> submit(std::vector<int64_t> input_ids, std::vector<int64_t> attention_mask);
+
+    BatchStats stats() const;
+
+private:
+    struct Request {
+        std::vector<int64_t> input_ids;
+        std::vector<int64_t> attention_mask;
+        std::promise<std::vector<float>> result;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    void dispatch();
+    // Requests at the head of the queue that fit in one batch, and whether
+    // they fill it.
+    size_t batchable(size_t* length, bool* full) const;
+    // `length` rounded up to the next of options_.lengths
+    size_t padded(size_t length) const;
+    void runBatch(std::vector<Request>& batch, size_t length, bool full);
+
+    BatchBackend backend_;
+    BatchOptions options_;
+    mutable std::mutex mutex_;
+    std::condition_variable queued_;
+    std::deque<Request> queue_;
+    bool stopping_ = false;
+    BatchStats stats_;
+    std::thread dispatcher_;
+};
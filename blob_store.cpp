@@ -0,0 +1,105 @@
+#include "blob_store.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// First line of the index; the rest is one "hash length offset crc32c"
+// line per blob, hash and crc32c in hex.
+constexpr const char* kIndexHeader = "# onnx_native blob store, alignment ";
+
+} // namespace
+
+BlobStore::BlobStore(std::string dir, size_t alignment) : dir_(std::move(dir)), alignment_(alignment) {
+    if (::mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Failed to create blob store " + dir_ + ": " + std::strerror(errno));
+    }
+    std::string lock_path = dir_ + "/index.lock";
+    lock_fd_ = ::open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd_ < 0 || ::flock(lock_fd_, LOCK_EX) != 0) {
+        throw std::runtime_error("Failed to lock " + lock_path + ": " + std::strerror(errno));
+    }
+
+    std::ifstream in(dir_ + "/index");
+    if (!in) return;  // a new store
+
+    std::string line;
+    std::getline(in, line);
+    size_t header = std::strlen(kIndexHeader);
+    if (line.compare(0, header, kIndexHeader) != 0) {
+        throw std::runtime_error("Not a blob store index: " + dir_ + "/index");
+    }
+    size_t stored_alignment = std::stoull(line.substr(header));
+    if (stored_alignment != alignment_) {
+        throw std::runtime_error("Blob store " + dir_ + " aligns blobs to " + std::to_string(stored_alignment)
+                                 + " bytes, pass --align=" + std::to_string(stored_alignment));
+    }
+    while (std::getline(in, line)) {
+        if (line.empty()) continue;
+        StoredBlob blob;
+        unsigned long long hash = 0, length = 0, offset = 0;
+        unsigned crc = 0;
+        if (sscanf(line.c_str(), "%llx %llu %llu %x", &hash, &length, &offset, &crc) != 4) {
+            throw std::runtime_error("Corrupt blob store index line: " + line);
+        }
+        blob.hash = hash;
+        blob.length = length;
+        blob.offset = offset;
+        blob.crc32c = crc;
+        blobs_.push_back(blob);
+    }
+}
+
+BlobStore::~BlobStore() {
+    if (lock_fd_ >= 0) ::close(lock_fd_);  // releases the lock
+}
+
+void BlobStore::seed(WeightsWriter& writer) const {
+    for (const auto& blob : blobs_) writer.reuse(blob);
+}
+
+void BlobStore::commit(const WeightsWriter& writer, const std::string& link) {
+    blobs_ = writer.blobs();
+
+    // Write the new index next to the old one and swap it in, so a crash
+    // leaves the previous index (the pack file only grew)
+    std::string path = dir_ + "/index";
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << kIndexHeader << alignment_ << "\n";
+        char buf[96];
+        for (const auto& blob : blobs_) {
+            snprintf(buf, sizeof(buf), "%016llx %llu %llu %08x\n",
+                     static_cast<unsigned long long>(blob.hash), static_cast<unsigned long long>(blob.length),
+                     static_cast<unsigned long long>(blob.offset), blob.crc32c);
+            out << buf;
+        }
+        out.close();
+        if (!out) throw std::runtime_error("Failed to write " + tmp);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Failed to replace " + path + ": " + std::strerror(errno));
+    }
+
+    // An absolute target keeps the link valid wherever the store was named from
+    char resolved[PATH_MAX];
+    if (!::realpath(pack_path().c_str(), resolved)) {
+        throw std::runtime_error("Failed to resolve " + pack_path() + ": " + std::strerror(errno));
+    }
+    ::unlink(link.c_str());
+    if (::symlink(resolved, link.c_str()) != 0) {
+        throw std::runtime_error("Failed to link " + link + " to " + resolved + ": " + std::strerror(errno));
+    }
+}
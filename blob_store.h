@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "weights_writer.h"
+
+// Content-addressed weights shared by several split models.
+//
+// DIR/blobs.data holds every distinct payload once, and DIR/index lists them
+// (XXH64, length, offset and CRC-32C per line). split appends only the
+// payloads the store does not hold yet, then points the model's weights file
+// at DIR/blobs.data through a symlink: ORT and onnx_test read it like any
+// other weights file, and a family of fine-tuned models sharing a base keeps
+// one copy of the shared weights on disk and in the page cache.
+//
+// The store only grows, so offsets recorded by models split earlier stay
+// valid. Concurrent splits are serialized by a lock on DIR/index.lock.
+
+class BlobStore {
+public:
+    // Creates `dir` if needed, takes the lock and reads the index. Every blob
+    // is aligned to `alignment`, which must match the store's. Throws
+    // std::runtime_error on failure.
+    BlobStore(std::string dir, size_t alignment);
+    ~BlobStore();
+
+    BlobStore(const BlobStore&) = delete;
+    BlobStore& operator=(const BlobStore&) = delete;
+
+    // The pack file, to be written by a WeightsWriter in append mode.
+    std::string pack_path() const { return dir_ + "/blobs.data"; }
+
+    size_t size() const { return blobs_.size(); }
+
+    // Let `writer` point tensors at the blobs already stored.
+    void seed(WeightsWriter& writer) const;
+
+    // Record every blob `writer` knows about in the index, and make `link`
+    // a symlink to the pack file.
+    void commit(const WeightsWriter& writer, const std::string& link);
+
+private:
+    std::string dir_;
+    size_t alignment_;
+    int lock_fd_ = -1;
+    std::vector<StoredBlob> blobs_;
+};
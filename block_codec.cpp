@@ -0,0 +1,536 @@
+#include "block_codec.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+//------------------------------------------------------------------------------
+// LZ4 block format
+//
+// A block is a series of sequences: a token (literal count, match length - 4),
+// the literals, a 2-byte little-endian back-reference offset and the match
+// length overflow bytes. The last sequence only has literals, and the last 5
+// bytes of a block are always literals.
+//------------------------------------------------------------------------------
+constexpr size_t kMinMatch = 4;
+constexpr size_t kLastLiterals = 5;
+constexpr size_t kMatchStartLimit = 12;  // no match starts in the last 12 bytes
+constexpr int kHashLog = 14;
+
+inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash4(uint32_t v) { return (v * 2654435761u) >> (32 - kHashLog); }
+
+// Append a length overflow (the part above 15) as 255-valued bytes.
+inline bool put_length(uint8_t*& op, const uint8_t* end, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (op >= end) return false;
+        *op++ = 255;
+    }
+    if (op >= end) return false;
+    *op++ = static_cast<uint8_t>(length);
+    return true;
+}
+
+// Returns the compressed size, or 0 if it would not fit in `capacity`.
+size_t lz4_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t capacity) {
+    uint8_t* op = dst;
+    const uint8_t* const op_end = dst + capacity;
+    size_t anchor = 0;
+
+    auto emit = [&](size_t literal_end, size_t offset, size_t match_length) -> bool {
+        size_t literals = literal_end - anchor;
+        if (op >= op_end) return false;
+        uint8_t* token = op++;
+        *token = static_cast<uint8_t>(std::min<size_t>(literals, 15) << 4);
+        if (literals >= 15 && !put_length(op, op_end, literals - 15)) return false;
+        if (static_cast<size_t>(op_end - op) < literals) return false;
+        std::memcpy(op, src + anchor, literals);
+        op += literals;
+        if (match_length == 0) return true;  // last sequence
+
+        if (op_end - op < 2) return false;
+        *op++ = static_cast<uint8_t>(offset);
+        *op++ = static_cast<uint8_t>(offset >> 8);
+        size_t extra = match_length - kMinMatch;
+        *token |= static_cast<uint8_t>(std::min<size_t>(extra, 15));
+        if (extra >= 15 && !put_length(op, op_end, extra - 15)) return false;
+        return true;
+    };
+
+    if (n >= kMatchStartLimit + 1) {
+        std::vector<int32_t> table(1u << kHashLog, -1);
+        const size_t match_start_limit = n - kMatchStartLimit;
+        const size_t match_end_limit = n - kLastLiterals;
+        size_t ip = 0;
+        while (ip < match_start_limit) {
+            uint32_t sequence = read32(src + ip);
+            uint32_t h = hash4(sequence);
+            int32_t ref = table[h];
+            table[h] = static_cast<int32_t>(ip);
+            if (ref < 0 || ip - ref > 65535 || read32(src + ref) != sequence) {
+                // Skip faster through data that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t length = kMinMatch;
+            while (ip + length < match_end_limit && src[ref + length] == src[ip + length]) length++;
+            if (!emit(ip, ip - ref, length)) return 0;
+            ip += length;
+            anchor = ip;
+            if (ip >= 2 && ip - 2 < match_start_limit) {
+                table[hash4(read32(src + ip - 2))] = static_cast<int32_t>(ip - 2);
+            }
+        }
+    }
+    if (!emit(n, 0, 0)) return 0;
+    return static_cast<size_t>(op - dst);
+}
+
+bool lz4_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t raw) {
+    size_t ip = 0, op = 0;
+    for (;;) {
+        if (ip >= n) return false;
+        uint8_t token = src[ip++];
+
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (ip >= n) return false;
+                b = src[ip++];
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > n - ip || literals > raw - op) return false;
+        std::memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == n) return op == raw;  // last sequence
+
+        if (n - ip < 2) return false;
+        size_t offset = src[ip] | (static_cast<size_t>(src[ip + 1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return false;
+
+        size_t length = token & 15;
+        if (length == 15) {
+            uint8_t b;
+            do {
+                if (ip >= n) return false;
+                b = src[ip++];
+                length += b;
+            } while (b == 255);
+        }
+        length += kMinMatch;
+        if (length > raw - op) return false;
+
+        uint8_t* out = dst + op;
+        const uint8_t* match = out - offset;
+        if (offset >= length) {
+            std::memcpy(out, match, length);
+        } else {
+            for (size_t i = 0; i < length; ++i) out[i] = match[i];  // overlapping run
+        }
+        op += length;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Order-0 rANS
+//
+// LZ4 finds no repeats in float weights, but once shuffled their sign and
+// exponent bytes have very low entropy. Each shuffled byte plane is entropy
+// coded on its own with a byte-wise rANS coder (32-bit state, 12-bit
+// probabilities). A coded plane is
+//   1 byte mode (0: raw, 1: rANS)
+//   rANS only: 32-byte symbol bitmap, a 2-byte frequency per present symbol,
+//              4-byte coded length, coded bytes (starting with both states)
+//------------------------------------------------------------------------------
+constexpr int kProbBits = 12;
+constexpr uint32_t kProbScale = 1u << kProbBits;
+constexpr uint32_t kRansLow = 1u << 23;
+
+// Scale the symbol counts of `src` to frequencies summing to kProbScale,
+// keeping every present symbol at 1 or more.
+void normalize_frequencies(const uint8_t* src, size_t n, uint32_t freq[256]) {
+    uint64_t counts[256] = {0};
+    for (size_t i = 0; i < n; ++i) counts[src[i]]++;
+
+    uint32_t total = 0;
+    int largest = 0;
+    for (int s = 0; s < 256; ++s) {
+        freq[s] = counts[s] ? std::max<uint32_t>(1, static_cast<uint32_t>(counts[s] * kProbScale / n)) : 0;
+        total += freq[s];
+        if (counts[s] > counts[largest]) largest = s;
+    }
+    // Settle the rounding error on the most frequent symbols
+    while (total != kProbScale) {
+        if (total < kProbScale) {
+            freq[largest] += kProbScale - total;
+            total = kProbScale;
+        } else {
+            int victim = -1;
+            for (int s = 0; s < 256; ++s) {
+                if (freq[s] > 1 && (victim < 0 || freq[s] > freq[victim])) victim = s;
+            }
+            uint32_t take = std::min(total - kProbScale, freq[victim] - 1);
+            freq[victim] -= take;
+            total -= take;
+        }
+    }
+}
+
+void append_raw_plane(const uint8_t* src, size_t n, std::string& out) {
+    out += '\0';
+    out.append(reinterpret_cast<const char*>(src), n);
+}
+
+void rans_encode_plane(const uint8_t* src, size_t n, std::string& out) {
+    if (n == 0) {
+        out += '\0';
+        return;
+    }
+    uint32_t freq[256], start[256];
+    normalize_frequencies(src, n, freq);
+    for (uint32_t s = 0, c = 0; s < 256; c += freq[s], ++s) start[s] = c;
+
+    // rANS emits bytes back to front; give up once it stops saving space
+    std::vector<uint8_t> coded(n);
+    uint8_t* const begin = coded.data();
+    uint8_t* ptr = begin + n;
+    // Two interleaved states (even and odd positions) halve the dependency
+    // chain the decoder waits on.
+    uint32_t x[2] = {kRansLow, kRansLow};
+    for (size_t i = n; i-- > 0;) {
+        uint32_t& state = x[i & 1];
+        uint32_t f = freq[src[i]];
+        uint32_t x_max = ((kRansLow >> kProbBits) << 8) * f;
+        while (state >= x_max) {
+            if (ptr == begin) return append_raw_plane(src, n, out);
+            *--ptr = static_cast<uint8_t>(state);
+            state >>= 8;
+        }
+        state = ((state / f) << kProbBits) + (state % f) + start[src[i]];
+    }
+    if (ptr - begin < 8) return append_raw_plane(src, n, out);
+    ptr -= 8;
+    std::memcpy(ptr, &x[0], 4);
+    std::memcpy(ptr + 4, &x[1], 4);
+
+    size_t coded_length = static_cast<size_t>(begin + n - ptr);
+    uint8_t bitmap[32] = {0};
+    size_t present = 0;
+    for (int s = 0; s < 256; ++s) {
+        if (freq[s]) {
+            bitmap[s >> 3] |= static_cast<uint8_t>(1u << (s & 7));
+            present++;
+        }
+    }
+    if (1 + 32 + 2 * present + 4 + coded_length >= 1 + n) return append_raw_plane(src, n, out);
+
+    out += '\1';
+    out.append(reinterpret_cast<const char*>(bitmap), sizeof(bitmap));
+    for (int s = 0; s < 256; ++s) {
+        if (!freq[s]) continue;
+        uint16_t f = static_cast<uint16_t>(freq[s] == kProbScale ? 0 : freq[s]);  // 4096 stored as 0
+        out.append(reinterpret_cast<const char*>(&f), 2);
+    }
+    uint32_t length32 = static_cast<uint32_t>(coded_length);
+    out.append(reinterpret_cast<const char*>(&length32), 4);
+    out.append(reinterpret_cast<const char*>(ptr), coded_length);
+}
+
+bool rans_decode_plane(const uint8_t*& ip, const uint8_t* end, uint8_t* dst, size_t n) {
+    if (ip >= end) return false;
+    uint8_t mode = *ip++;
+    if (mode == 0) {
+        if (static_cast<size_t>(end - ip) < n) return false;
+        std::memcpy(dst, ip, n);
+        ip += n;
+        return true;
+    }
+    if (mode != 1 || end - ip < 32) return false;
+
+    const uint8_t* bitmap = ip;
+    ip += 32;
+    uint32_t freq[256], start[256];
+    uint32_t total = 0;
+    for (int s = 0; s < 256; ++s) {
+        freq[s] = 0;
+        if (bitmap[s >> 3] & (1u << (s & 7))) {
+            if (end - ip < 2) return false;
+            uint16_t f;
+            std::memcpy(&f, ip, 2);
+            ip += 2;
+            freq[s] = f ? f : kProbScale;
+        }
+        start[s] = total;
+        total += freq[s];
+    }
+    if (total != kProbScale) return false;
+
+    uint8_t symbol_of[kProbScale];
+    for (int s = 0; s < 256; ++s) std::memset(symbol_of + start[s], s, freq[s]);
+
+    if (end - ip < 4) return false;
+    uint32_t coded_length;
+    std::memcpy(&coded_length, ip, 4);
+    ip += 4;
+    if (coded_length < 8 || static_cast<size_t>(end - ip) < coded_length) return false;
+    const uint8_t* p = ip;
+    const uint8_t* coded_end = ip + coded_length;
+    ip = coded_end;
+
+    uint32_t x[2];
+    std::memcpy(&x[0], p, 4);
+    std::memcpy(&x[1], p + 4, 4);
+    p += 8;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t& state = x[i & 1];
+        uint32_t slot = state & (kProbScale - 1);
+        uint8_t s = symbol_of[slot];
+        dst[i] = s;
+        state = freq[s] * (state >> kProbBits) + slot - start[s];
+        while (state < kRansLow) {
+            if (p == coded_end) return false;
+            state = (state << 8) | *p++;
+        }
+    }
+    return p == coded_end && x[0] == kRansLow && x[1] == kRansLow;
+}
+
+void shuffle(const char* src, char* dst, size_t length, size_t element_size) {
+    size_t count = length / element_size;
+    for (size_t b = 0; b < element_size; ++b) {
+        char* plane = dst + b * count;
+        for (size_t i = 0; i < count; ++i) plane[i] = src[i * element_size + b];
+    }
+    size_t tail = count * element_size;
+    std::memcpy(dst + tail, src + tail, length - tail);
+}
+
+void unshuffle(const char* src, char* dst, size_t length, size_t element_size) {
+    size_t count = length / element_size;
+    for (size_t b = 0; b < element_size; ++b) {
+        const char* plane = src + b * count;
+        for (size_t i = 0; i < count; ++i) dst[i * element_size + b] = plane[i];
+    }
+    size_t tail = count * element_size;
+    std::memcpy(dst + tail, src + tail, length - tail);
+}
+
+unsigned pool_size(unsigned threads, size_t jobs) {
+    if (threads == 0) threads = std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+    return static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, jobs)));
+}
+
+template <typename Fn>
+void run_pool(unsigned threads, size_t jobs, Fn fn) {
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < jobs; i = next++) fn(i);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool) thread.join();
+}
+
+} // namespace
+
+uint64_t stored_length(const BlockLayout& layout) {
+    uint64_t total = 0;
+    for (uint32_t size : layout.blocks) total += size;
+    return total;
+}
+
+void compress_blocks(const char* raw, size_t length, BlockLayout& layout, std::string& out,
+                     unsigned threads) {
+    if (layout.block_size == 0) layout.block_size = 256 << 10;
+    if (layout.codec == Codec::Lz4) layout.element_size = 1;
+    layout.raw_length = length;
+
+    size_t count = (length + layout.block_size - 1) / layout.block_size;
+    std::vector<std::string> compressed(count);
+    run_pool(pool_size(threads, count), count, [&](size_t b) {
+        size_t begin = b * layout.block_size;
+        size_t size = std::min<size_t>(layout.block_size, length - begin);
+        const char* block = raw + begin;
+
+        std::string shuffled;
+        if (layout.codec != Codec::Lz4 && layout.element_size > 1) {
+            shuffled.resize(size);
+            shuffle(block, &shuffled[0], size, layout.element_size);
+            block = shuffled.data();
+        }
+
+        // Anything that does not shrink is stored raw (and unshuffled)
+        std::string& dst = compressed[b];
+        size_t n = 0;
+        if (layout.codec == Codec::ShuffleRans) {
+            const uint8_t* planes = reinterpret_cast<const uint8_t*>(block);
+            size_t count = size / layout.element_size;
+            for (size_t plane = 0; plane < layout.element_size; ++plane) {
+                rans_encode_plane(planes + plane * count, count, dst);
+            }
+            dst.append(block + count * layout.element_size, size - count * layout.element_size);
+            n = dst.size() < size ? dst.size() : 0;
+        } else {
+            dst.resize(size);
+            n = size > 1 ? lz4_compress(reinterpret_cast<const uint8_t*>(block), size,
+                                        reinterpret_cast<uint8_t*>(&dst[0]), size - 1)
+                         : 0;
+        }
+        if (n == 0) dst.assign(raw + begin, size);
+        else dst.resize(n);
+    });
+
+    layout.blocks.clear();
+    size_t total = 0;
+    for (const auto& block : compressed) total += block.size();
+    out.clear();
+    out.reserve(total);
+    for (const auto& block : compressed) {
+        layout.blocks.push_back(static_cast<uint32_t>(block.size()));
+        out += block;
+    }
+}
+
+bool decompress_blocks(const std::vector<DecodeTarget>& targets, unsigned threads, DecodeStats* stats) {
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    struct Job {
+        const DecodeTarget* target;
+        const char* src;
+        uint32_t stored;
+        char* dest;
+        size_t raw;
+    };
+    std::vector<Job> jobs;
+    DecodeStats local;
+    DecodeStats& st = stats ? *stats : local;
+    st = DecodeStats();
+    for (const auto& target : targets) {
+        const BlockLayout& layout = *target.layout;
+        const char* src = target.src;
+        for (size_t b = 0; b < layout.blocks.size(); ++b) {
+            uint64_t offset = b * layout.block_size;
+            size_t raw = static_cast<size_t>(std::min<uint64_t>(layout.block_size, layout.raw_length - offset));
+            jobs.push_back({&target, src, layout.blocks[b], target.dest + offset, raw});
+            src += layout.blocks[b];
+        }
+        st.tensors++;
+        st.stored_bytes += stored_length(layout);
+        st.raw_bytes += layout.raw_length;
+    }
+    st.blocks = jobs.size();
+    st.threads = pool_size(threads, jobs.size());
+
+    std::atomic<bool> ok{true};
+    std::mutex error_mutex;
+    run_pool(st.threads, jobs.size(), [&](size_t i) {
+        const Job& job = jobs[i];
+        const BlockLayout& layout = *job.target->layout;
+        bool decoded = true;
+        if (job.stored == job.raw) {
+            std::memcpy(job.dest, job.src, job.raw);  // stored raw
+        } else if (layout.codec == Codec::ShuffleRans) {
+            std::string shuffled(job.raw, '\0');
+            uint8_t* planes = reinterpret_cast<uint8_t*>(&shuffled[0]);
+            const uint8_t* ip = reinterpret_cast<const uint8_t*>(job.src);
+            const uint8_t* end = ip + job.stored;
+            size_t count = job.raw / layout.element_size;
+            for (size_t plane = 0; plane < layout.element_size && decoded; ++plane) {
+                decoded = rans_decode_plane(ip, end, planes + plane * count, count);
+            }
+            size_t tail = job.raw - count * layout.element_size;
+            decoded = decoded && static_cast<size_t>(end - ip) == tail;
+            if (decoded) {
+                std::memcpy(planes + count * layout.element_size, ip, tail);
+                unshuffle(shuffled.data(), job.dest, job.raw, layout.element_size);
+            }
+        } else if (layout.codec == Codec::ShuffleLz4 && layout.element_size > 1) {
+            std::string shuffled(job.raw, '\0');
+            decoded = lz4_decompress(reinterpret_cast<const uint8_t*>(job.src), job.stored,
+                                     reinterpret_cast<uint8_t*>(&shuffled[0]), job.raw);
+            if (decoded) unshuffle(shuffled.data(), job.dest, job.raw, layout.element_size);
+        } else {
+            decoded = lz4_decompress(reinterpret_cast<const uint8_t*>(job.src), job.stored,
+                                     reinterpret_cast<uint8_t*>(job.dest), job.raw);
+        }
+        if (!decoded) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            std::cerr << "Corrupt compressed block in tensor "
+                      << (job.target->name ? *job.target->name : std::string("?")) << "\n";
+            ok = false;
+        }
+    });
+
+    st.elapsed_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - begin).count();
+    return ok;
+}
+
+std::string codec_name(const BlockLayout& layout) {
+    switch (layout.codec) {
+    case Codec::Lz4:
+        return "lz4";
+    case Codec::ShuffleLz4:
+        return "shuffle" + std::to_string(layout.element_size) + "+lz4";
+    case Codec::ShuffleRans:
+        return "shuffle" + std::to_string(layout.element_size) + "+rans";
+    default:
+        return "none";
+    }
+}
+
+bool parse_codec_name(const std::string& name, BlockLayout& layout) {
+    if (name == "lz4") {
+        layout.codec = Codec::Lz4;
+        layout.element_size = 1;
+        return true;
+    }
+    size_t plus = name.find('+');
+    if (name.compare(0, 7, "shuffle") == 0 && plus != std::string::npos
+        && (name.substr(plus) == "+lz4" || name.substr(plus) == "+rans")) {
+        layout.codec = name.substr(plus) == "+lz4" ? Codec::ShuffleLz4 : Codec::ShuffleRans;
+        layout.element_size = std::strtoul(name.c_str() + 7, nullptr, 10);
+        return layout.element_size > 0;
+    }
+    return false;
+}
+
+std::string format_block_sizes(const std::vector<uint32_t>& blocks) {
+    std::string value;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (i > 0) value += ',';
+        value += std::to_string(blocks[i]);
+    }
+    return value;
+}
+
+bool parse_block_sizes(const std::string& value, std::vector<uint32_t>& blocks) {
+    blocks.clear();
+    const char* p = value.c_str();
+    while (*p) {
+        char* end = nullptr;
+        unsigned long size = std::strtoul(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0')) return false;
+        blocks.push_back(static_cast<uint32_t>(size));
+        p = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
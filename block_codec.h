@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Block compression for external tensor data.
+//
+// A tensor payload is cut into fixed-size blocks that are compressed on their
+// own, so they can be decompressed in parallel and straight into the final
+// tensor buffer. Each block is optionally byte-shuffled first (byte 0 of
+// every element, then byte 1, ...), which groups the slowly varying sign and
+// exponent bytes of floats together. It is then compressed with a
+// self-contained LZ4 block-format codec, or each byte plane is entropy coded
+// with order-0 rANS, which suits float weights much better: they hold few
+// repeats for LZ4 to find, but their exponent bytes have low entropy. Blocks
+// that do not shrink are stored as they are.
+//
+// The layout is described by the tensor's external_data entries:
+//   compression  "lz4", "shuffle<element size>+lz4" or "shuffle<element size>+rans"
+//   block_size   uncompressed size of every block but the last
+//   raw_length   uncompressed size of the whole payload
+//   blocks       comma-separated stored size of each block
+// ONNX Runtime rejects these keys, so such models can only be loaded through
+// onnx_test's inline and lowpeak loaders, which strip them.
+
+enum class Codec {
+    None,
+    Lz4,         // LZ4 block format
+    ShuffleLz4,  // byte shuffle by element size, then LZ4
+    ShuffleRans, // byte shuffle by element size, then rANS per byte plane
+};
+
+struct BlockLayout {
+    Codec codec = Codec::None;
+    size_t element_size = 1;      // shuffle stride
+    uint64_t block_size = 0;
+    uint64_t raw_length = 0;
+    std::vector<uint32_t> blocks;  // stored size of each block
+};
+
+// Compressed size of the whole payload described by `layout`.
+uint64_t stored_length(const BlockLayout& layout);
+
+// Compress `raw` into `out` according to layout.codec, element_size and
+// block_size, filling in the rest of `layout`. Blocks are compressed on up
+// to `threads` threads (0: one per core, capped at 8).
+void compress_blocks(const char* raw, size_t length, BlockLayout& layout, std::string& out,
+                     unsigned threads = 0);
+
+// One payload to decompress: `stored_length(layout)` bytes at `src` become
+// layout.raw_length bytes at `dest`.
+struct DecodeTarget {
+    const BlockLayout* layout = nullptr;
+    const char* src = nullptr;
+    char* dest = nullptr;
+    const std::string* name = nullptr;  // for error messages
+};
+
+struct DecodeStats {
+    size_t tensors = 0;
+    size_t blocks = 0;
+    uint64_t stored_bytes = 0;
+    uint64_t raw_bytes = 0;
+    unsigned threads = 0;
+    double elapsed_ms = 0;
+};
+
+// Decompress every block of every target on a pool of threads. Returns
+// false (after printing the reason) if a block is corrupt.
+bool decompress_blocks(const std::vector<DecodeTarget>& targets, unsigned threads,
+                       DecodeStats* stats = nullptr);
+
+// external_data values for a layout, and back.
+std::string codec_name(const BlockLayout& layout);
+bool parse_codec_name(const std::string& name, BlockLayout& layout);
+std::string format_block_sizes(const std::vector<uint32_t>& blocks);
+bool parse_block_sizes(const std::string& value, std::vector<uint32_t>& blocks);
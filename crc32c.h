@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and SSE4.2's crc32
+// instruction. crc32c() extends `crc` with `data`, zlib style: start from 0
+// and feed the previous result back in to checksum data piece by piece.
+
+namespace crc32c_detail {
+
+constexpr uint32_t kPoly = 0x82F63B78u;  // reflected Castagnoli polynomial
+
+struct Table {
+    uint32_t entries[256];
+    Table() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (kPoly & (0u - (c & 1u)));
+            entries[i] = c;
+        }
+    }
+};
+
+inline uint32_t software(uint32_t crc, const unsigned char* p, size_t length) {
+    static const Table table;
+    for (size_t i = 0; i < length; ++i) crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t hardware(uint32_t crc, const unsigned char* p, size_t length) {
+    uint64_t c = crc;
+    for (; length >= 8; p += 8, length -= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    for (; length > 0; ++p, --length) c32 = _mm_crc32_u8(c32, *p);
+    return c32;
+}
+
+inline bool has_hardware() {
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+inline const char* hardware_name() { return "sse4.2"; }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+inline uint32_t hardware(uint32_t crc, const unsigned char* p, size_t length) {
+    for (; length >= 8; p += 8, length -= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    for (; length > 0; ++p, --length) crc = __crc32cb(crc, *p);
+    return crc;
+}
+
+inline bool has_hardware() { return true; }
+inline const char* hardware_name() { return "armv8 crc"; }
+#else
+inline uint32_t hardware(uint32_t crc, const unsigned char* p, size_t length) { return software(crc, p, length); }
+inline bool has_hardware() { return false; }
+inline const char* hardware_name() { return "software"; }
+#endif
+
+inline uint32_t gf2_times(const uint32_t* matrix, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++matrix) {
+        if (vec & 1) sum ^= *matrix;
+    }
+    return sum;
+}
+
+inline void gf2_square(uint32_t* square, const uint32_t* matrix) {
+    for (int n = 0; n < 32; ++n) square[n] = gf2_times(matrix, matrix[n]);
+}
+
+} // namespace crc32c_detail
+
+inline uint32_t crc32c(const void* data, size_t length, uint32_t crc = 0) {
+    using namespace crc32c_detail;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    crc = has_hardware() ? hardware(crc, p, length) : software(crc, p, length);
+    return ~crc;
+}
+
+// Which implementation crc32c() runs on this CPU, for reports.
+inline const char* crc32c_implementation() {
+    using namespace crc32c_detail;
+    return has_hardware() ? hardware_name() : "software";
+}
+
+// CRC of A followed by B, given crc32c(A), crc32c(B) and the length of B
+// (the zlib crc32_combine algorithm). Lets large buffers be checksummed in
+// chunks on several threads.
+inline uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t length_b) {
+    using namespace crc32c_detail;
+    if (length_b == 0) return crc_a;
+
+    uint32_t even[32], odd[32];
+    odd[0] = kPoly;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; ++n, row <<= 1) odd[n] = row;
+    gf2_square(even, odd);  // two zero bits
+    gf2_square(odd, even);  // four zero bits
+
+    do {
+        gf2_square(even, odd);
+        if (length_b & 1) crc_a = gf2_times(even, crc_a);
+        length_b >>= 1;
+        if (!length_b) break;
+        gf2_square(odd, even);
+        if (length_b & 1) crc_a = gf2_times(odd, crc_a);
+        length_b >>= 1;
+    } while (length_b);
+
+    return crc_a ^ crc_b;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <vector>
+#include "onnx.pb.h"
+
+// Where an EXTERNAL tensor's payload lives, decoded from its external_data
+// key/value entries as written by split.
+struct ExternalDataInfo {
+    std::string location;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    std::string checksum;  // "crc32c:<8 hex digits>", empty if not recorded
+    // Block compression (see block_codec.h). `length` is then the stored
+    // size and `raw_length` the size once decompressed.
+    std::string compression;  // empty if stored as is
+    uint64_t block_size = 0;
+    uint64_t raw_length = 0;
+    std::string blocks;
+};
+
+inline ExternalDataInfo get_external_data_info(const onnx::TensorProto& tensor) {
+    ExternalDataInfo info;
+    for (const auto& entry : tensor.external_data()) {
+        if (entry.key() == "location") info.location = entry.value();
+        else if (entry.key() == "offset") info.offset = std::stoull(entry.value());
+        else if (entry.key() == "length") info.length = std::stoull(entry.value());
+        else if (entry.key() == "checksum") info.checksum = entry.value();
+        else if (entry.key() == "compression") info.compression = entry.value();
+        else if (entry.key() == "block_size") info.block_size = std::stoull(entry.value());
+        else if (entry.key() == "raw_length") info.raw_length = std::stoull(entry.value());
+        else if (entry.key() == "blocks") info.blocks = entry.value();
+    }
+    return info;
+}
+
+// Every tensor of a graph that can live in an external file: initializers,
+// the values and indices of sparse initializers, and the tensors of Constant
+// nodes, in this graph and in the If/Loop/Scan subgraphs below it.
+inline void collect_graph_tensors(onnx::GraphProto& graph, std::vector<onnx::TensorProto*>& out) {
+    for (auto& tensor : *graph.mutable_initializer()) out.push_back(&tensor);
+    for (auto& sparse : *graph.mutable_sparse_initializer()) {
+        out.push_back(sparse.mutable_values());
+        out.push_back(sparse.mutable_indices());
+    }
+    for (auto& node : *graph.mutable_node()) {
+        for (auto& attr : *node.mutable_attribute()) {
+            if (node.op_type() == "Constant" && node.domain().empty() && attr.name() == "value" && attr.has_t()) {
+                out.push_back(attr.mutable_t());
+            }
+            if (attr.has_g()) collect_graph_tensors(*attr.mutable_g(), out);
+            for (auto& subgraph : *attr.mutable_graphs()) collect_graph_tensors(subgraph, out);
+        }
+    }
+}
+
+inline std::vector<onnx::TensorProto*> model_tensors(onnx::ModelProto& model) {
+    std::vector<onnx::TensorProto*> tensors;
+    collect_graph_tensors(*model.mutable_graph(), tensors);
+    return tensors;
+}
+
+// Read-only walk; the model is not modified.
+inline std::vector<const onnx::TensorProto*> model_tensors(const onnx::ModelProto& model) {
+    std::vector<onnx::TensorProto*> tensors = model_tensors(const_cast<onnx::ModelProto&>(model));
+    return {tensors.begin(), tensors.end()};
+}
+
+// Size of the payload once read back, decompressed if needed.
+inline uint64_t decoded_length(const ExternalDataInfo& info) {
+    return info.compression.empty() ? info.length : info.raw_length;
+}
+
+// True if any external tensor is block-compressed.
+inline bool has_compressed_external_data(const onnx::ModelProto& model) {
+    for (const auto* tensor : model_tensors(model)) {
+        if (tensor->data_location() != onnx::TensorProto_DataLocation_EXTERNAL) continue;
+        if (!get_external_data_info(*tensor).compression.empty()) return true;
+    }
+    return false;
+}
+
+// split records checksums under the spec's "checksum" key, which ORT accepts
+// and ignores (it rejects unknown keys), prefixed with the algorithm name.
+inline std::string format_crc32c_checksum(uint32_t crc) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08x", crc);
+    return std::string("crc32c:") + buf;
+}
+
+inline bool parse_crc32c_checksum(const std::string& value, uint32_t* crc) {
+    if (value.size() != 15 || value.compare(0, 7, "crc32c:") != 0) return false;
+    char* end = nullptr;
+    unsigned long parsed = std::strtoul(value.c_str() + 7, &end, 16);
+    if (end != value.c_str() + value.size()) return false;
+    *crc = static_cast<uint32_t>(parsed);
+    return true;
+}
+
+// True if every external tensor carries a checksum split recorded.
+inline bool has_external_data_checksums(const onnx::ModelProto& model) {
+    uint32_t crc;
+    for (const auto* tensor : model_tensors(model)) {
+        if (tensor->data_location() != onnx::TensorProto_DataLocation_EXTERNAL) continue;
+        if (!parse_crc32c_checksum(get_external_data_info(*tensor).checksum, &crc)) return false;
+    }
+    return true;
+}
+
+// Model metadata key under which split records the tensor alignment
+constexpr const char* kExternalDataAlignmentKey = "onnx_native.external_data_alignment";
+
+// Alignment split guaranteed for every tensor offset, recorded in the
+// model's metadata. 1 for files written without it.
+inline size_t external_data_alignment(const onnx::ModelProto& model) {
+    for (const auto& entry : model.metadata_props()) {
+        if (entry.key() == kExternalDataAlignmentKey) return std::stoull(entry.value());
+    }
+    return 1;
+}
+
+// Model metadata key set when split stored the external float initializers
+// as 16-bit values ("fp16" or "bf16") while the graph still declares them
+// float. Such tensors have to be widened on load.
+constexpr const char* kFloatStorageKey = "onnx_native.float_storage";
+
+// "fp16", "bf16", or empty when float tensors are stored as float.
+inline std::string external_float_storage(const onnx::ModelProto& model) {
+    for (const auto& entry : model.metadata_props()) {
+        if (entry.key() == kFloatStorageKey) return entry.value();
+    }
+    return "";
+}
+
+// Distinct external data files referenced by the model's tensors.
+inline std::vector<std::string> external_data_locations(const onnx::ModelProto& model) {
+    std::set<std::string> locations;
+    for (const auto* tensor : model_tensors(model)) {
+        if (tensor->data_location() != onnx::TensorProto_DataLocation_EXTERNAL) continue;
+        locations.insert(get_external_data_info(*tensor).location);
+    }
+    return {locations.begin(), locations.end()};
+}
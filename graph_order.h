@@ -0,0 +1,114 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "onnx.pb.h"
+#include "external_data.h"
+
+// Nodes of `graph` in topological order (Kahn's algorithm, ties broken by
+// protobuf order). ONNX asks exporters to store nodes sorted already, but not
+// all of them do. Nodes caught in a cycle are appended in protobuf order.
+inline std::vector<const onnx::NodeProto*> topological_order(const onnx::GraphProto& graph) {
+    const int n = graph.node_size();
+    std::unordered_map<std::string, int> producer;
+    for (int i = 0; i < n; ++i) {
+        for (const auto& output : graph.node(i).output()) {
+            if (!output.empty()) producer[output] = i;
+        }
+    }
+
+    std::vector<int> pending(n, 0);
+    std::vector<std::vector<int>> consumers(n);
+    for (int i = 0; i < n; ++i) {
+        for (const auto& input : graph.node(i).input()) {
+            auto it = producer.find(input);
+            if (it == producer.end() || it->second == i) continue;
+            consumers[it->second].push_back(i);
+            pending[i]++;
+        }
+    }
+
+    std::deque<int> ready;
+    for (int i = 0; i < n; ++i) {
+        if (pending[i] == 0) ready.push_back(i);
+    }
+
+    std::vector<const onnx::NodeProto*> order;
+    std::vector<bool> emitted(n, false);
+    while (!ready.empty()) {
+        int i = ready.front();
+        ready.pop_front();
+        order.push_back(&graph.node(i));
+        emitted[i] = true;
+        for (int c : consumers[i]) {
+            if (--pending[c] == 0) ready.push_back(c);
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        if (!emitted[i]) order.push_back(&graph.node(i));
+    }
+    return order;
+}
+
+// Initializer names in the order their first consumer runs. Initializers no
+// node reads directly (e.g. only used inside a subgraph) come last, in
+// protobuf order.
+inline std::vector<std::string> initializers_in_consumer_order(const onnx::GraphProto& graph) {
+    std::unordered_set<std::string> initializers;
+    for (const auto& tensor : graph.initializer()) initializers.insert(tensor.name());
+
+    std::vector<std::string> order;
+    std::unordered_set<std::string> seen;
+    for (const onnx::NodeProto* node : topological_order(graph)) {
+        for (const auto& input : node->input()) {
+            if (initializers.count(input) && seen.insert(input).second) order.push_back(input);
+        }
+    }
+    for (const auto& tensor : graph.initializer()) {
+        if (seen.insert(tensor.name()).second) order.push_back(tensor.name());
+    }
+    return order;
+}
+
+// Every tensor model_tensors() returns, ordered by when the main graph first
+// needs it: initializers (sparse ones included) at their first consumer, a
+// Constant node's tensor at that node, and the tensors of an If/Loop/Scan
+// subgraph at the node that owns it. Anything else comes last, in
+// model_tensors() order.
+inline std::vector<onnx::TensorProto*> tensors_in_consumer_order(onnx::ModelProto& model) {
+    onnx::GraphProto& graph = *model.mutable_graph();
+    std::unordered_map<std::string, std::vector<onnx::TensorProto*>> by_name;
+    for (auto& tensor : *graph.mutable_initializer()) by_name[tensor.name()].push_back(&tensor);
+    for (auto& sparse : *graph.mutable_sparse_initializer()) {
+        by_name[sparse.values().name()].push_back(sparse.mutable_values());
+        by_name[sparse.values().name()].push_back(sparse.mutable_indices());
+    }
+
+    std::vector<onnx::TensorProto*> order;
+    std::unordered_set<const onnx::TensorProto*> seen;
+    auto take = [&](onnx::TensorProto* tensor) {
+        if (seen.insert(tensor).second) order.push_back(tensor);
+    };
+    for (const onnx::NodeProto* node : topological_order(graph)) {
+        for (const auto& input : node->input()) {
+            auto it = by_name.find(input);
+            if (it == by_name.end()) continue;
+            for (onnx::TensorProto* tensor : it->second) take(tensor);
+        }
+        auto* mutable_node = const_cast<onnx::NodeProto*>(node);
+        for (auto& attr : *mutable_node->mutable_attribute()) {
+            std::vector<onnx::TensorProto*> nested;
+            if (node->op_type() == "Constant" && node->domain().empty() && attr.name() == "value" && attr.has_t()) {
+                nested.push_back(attr.mutable_t());
+            }
+            if (attr.has_g()) collect_graph_tensors(*attr.mutable_g(), nested);
+            for (auto& subgraph : *attr.mutable_graphs()) collect_graph_tensors(subgraph, nested);
+            for (onnx::TensorProto* tensor : nested) take(tensor);
+        }
+    }
+    for (onnx::TensorProto* tensor : model_tensors(model)) take(tensor);
+    return order;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// fp32 <-> fp16 / bf16 conversion of whole buffers, rounding to nearest even.
+//
+// On x86-64 the fp16 conversions use AVX-512F or F16C and the bf16 ones
+// AVX2, picked at run time; other CPUs take the scalar path.
+//
+// Source and destination must not overlap, except through
+// widen_in_place(), which converts 16-bit values stored in the upper half of
+// their own fp32 buffer.
+
+namespace half_detail {
+
+inline uint32_t bits_of(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    return x;
+}
+
+inline float float_of(uint32_t x) {
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+inline uint16_t to_half(float f) {
+    uint32_t x = bits_of(f);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+    if (abs > 0x7f800000) return static_cast<uint16_t>(sign | 0x7e00 | ((abs & 0x7fffff) >> 13));  // quiet NaN
+    if (abs == 0x7f800000) return static_cast<uint16_t>(sign | 0x7c00);
+    if (abs >= 0x477ff000) return static_cast<uint16_t>(sign | 0x7c00);  // rounds past 65504
+    if (abs < 0x38800000) {
+        // Subnormal or zero: adding 0.5 lines the fp16 subnormal ulp up with
+        // the fp32 ulp, so the FPU does the rounding.
+        uint32_t r = bits_of(float_of(abs) + 0.5f) - 0x3f000000;
+        return static_cast<uint16_t>(sign | r);
+    }
+    abs += 0xc8000fff + ((abs >> 13) & 1);  // rebias the exponent and round
+    return static_cast<uint16_t>(sign | (abs >> 13));
+}
+
+inline float from_half(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    if (exp == 0x1f) return float_of(sign | 0x7f800000 | (mant << 13));
+    if (exp == 0) return float_of(sign | bits_of(static_cast<float>(mant) * (1.0f / 16777216.0f)));
+    return float_of(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+inline uint16_t to_bfloat16(float f) {
+    uint32_t x = bits_of(f);
+    if ((x & 0x7fffffff) > 0x7f800000) return static_cast<uint16_t>((x >> 16) | 0x40);  // quiet NaN
+    return static_cast<uint16_t>((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+}
+
+inline float from_bfloat16(uint16_t b) { return float_of(static_cast<uint32_t>(b) << 16); }
+
+#if defined(__x86_64__)
+inline bool has_avx512f() {
+    static const bool supported = __builtin_cpu_supports("avx512f");
+    return supported;
+}
+
+inline bool has_f16c() {
+    static const bool supported = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    return supported;
+}
+
+inline bool has_avx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+__attribute__((target("avx512f")))
+inline size_t to_half_avx512(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // Masked, like from_half_avx512
+        __m256i h = _mm512_maskz_cvtps_ph(0xffff, _mm512_loadu_ps(src + i),
+                                          _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), h);
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+inline size_t from_half_avx512(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // The masked form: the plain one starts from an undefined vector, which
+        // g++ reports as maybe-uninitialized
+        __m512 f = _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        _mm512_storeu_ps(dst + i, f);
+    }
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+inline size_t to_half_f16c(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+    }
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+inline size_t from_half_f16c(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 f = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i, f);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t to_bfloat16_avx2(const float* src, uint16_t* dst, size_t n) {
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i bias = _mm256_set1_epi32(0x7fff);
+    const __m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
+    const __m256i inf = _mm256_set1_epi32(0x7f800000);
+    const __m256i quiet = _mm256_set1_epi32(0x400000);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(x, 16), one);
+        __m256i rounded = _mm256_add_epi32(_mm256_add_epi32(x, bias), lsb);
+        __m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(x, abs_mask), inf);
+        __m256i r = _mm256_blendv_epi8(rounded, _mm256_or_si256(x, quiet), nan);
+        r = _mm256_srli_epi32(r, 16);
+        // pack works per 128-bit lane: gather the two low halves afterwards
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0x08);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_castsi256_si128(packed));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t from_bfloat16_avx2(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_slli_epi32(x, 16));
+    }
+    return i;
+}
+#endif
+
+} // namespace half_detail
+
+inline void float_to_half(const float* src, uint16_t* dst, size_t n) {
+    using namespace half_detail;
+    size_t i = 0;
+#if defined(__x86_64__)
+    if (has_avx512f()) i = to_half_avx512(src, dst, n);
+    else if (has_f16c()) i = to_half_f16c(src, dst, n);
+#endif
+    for (; i < n; ++i) dst[i] = to_half(src[i]);
+}
+
+inline void half_to_float(const uint16_t* src, float* dst, size_t n) {
+    using namespace half_detail;
+    size_t i = 0;
+#if defined(__x86_64__)
+    if (has_avx512f()) i = from_half_avx512(src, dst, n);
+    else if (has_f16c()) i = from_half_f16c(src, dst, n);
+#endif
+    for (; i < n; ++i) dst[i] = from_half(src[i]);
+}
+
+inline void float_to_bfloat16(const float* src, uint16_t* dst, size_t n) {
+    using namespace half_detail;
+    size_t i = 0;
+#if defined(__x86_64__)
+    if (has_avx2()) i = to_bfloat16_avx2(src, dst, n);
+#endif
+    for (; i < n; ++i) dst[i] = to_bfloat16(src[i]);
+}
+
+inline void bfloat16_to_float(const uint16_t* src, float* dst, size_t n) {
+    using namespace half_detail;
+    size_t i = 0;
+#if defined(__x86_64__)
+    if (has_avx2()) i = from_bfloat16_avx2(src, dst, n);
+#endif
+    for (; i < n; ++i) dst[i] = from_bfloat16(src[i]);
+}
+
+// `buffer` holds room for n floats, with n fp16 (or bf16) values in its upper
+// half, starting 2n bytes in. Converts them to floats filling the buffer.
+// Blocks are widened front to back through a small copy: block i's output
+// only ever overwrites input that earlier blocks already consumed.
+inline void widen_in_place(void* buffer, size_t n, bool bfloat16) {
+    constexpr size_t kBlock = 512;
+    uint16_t block[kBlock];
+    char* bytes = static_cast<char*>(buffer);
+    for (size_t i = 0; i < n; i += kBlock) {
+        size_t count = n - i < kBlock ? n - i : kBlock;
+        std::memcpy(block, bytes + 2 * n + 2 * i, count * sizeof(uint16_t));
+        float* dst = reinterpret_cast<float*>(bytes + 4 * i);
+        if (bfloat16) bfloat16_to_float(block, dst, count);
+        else half_to_float(block, dst, count);
+    }
+}
+
+// Vector instructions the fp16 conversions run on, for reports.
+inline const char* half_convert_implementation() {
+#if defined(__x86_64__)
+    if (half_detail::has_avx512f()) return "avx512f";
+    if (half_detail::has_f16c()) return "f16c";
+#endif
+    return "scalar";
+}
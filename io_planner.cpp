@@ -0,0 +1,406 @@
+#include "io_planner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace {
+
+// One coalesced read: a contiguous file range scattered into the target
+// buffers, with any holes between targets read into a throwaway buffer.
+struct Span {
+    int fd = -1;
+    const std::string* location = nullptr;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    std::vector<iovec> iov;
+    std::vector<char> hole;
+};
+
+// Read a whole span with preadv(), resuming after short reads.
+bool read_span(const Span& span) {
+    std::vector<iovec> iov = span.iov;
+    size_t first = 0;
+    uint64_t offset = span.offset;
+    uint64_t remaining = span.length;
+
+    while (remaining > 0) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t n = preadv(span.fd, iov.data() + first, count, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+
+        offset += n;
+        remaining -= n;
+        size_t left = static_cast<size_t>(n);
+        while (left > 0) {
+            if (left >= iov[first].iov_len) {
+                left -= iov[first].iov_len;
+                first++;
+            } else {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+                iov[first].iov_len -= left;
+                left = 0;
+            }
+        }
+    }
+    return true;
+}
+
+// Build the coalesced reads for one file. `targets` must be sorted by offset.
+void plan_file(int fd, const std::string& location,
+               const std::vector<const ReadTarget*>& targets,
+               const IoOptions& options, std::vector<Span>& spans) {
+    // Each pending span remembers its pieces first: a hole buffer can only be
+    // pointed at once we know how large the largest gap is.
+    struct Piece { const ReadTarget* target; uint64_t gap; };
+    std::vector<Piece> pieces;
+    uint64_t span_start = 0, span_end = 0;
+
+    auto flush = [&]() {
+        if (pieces.empty()) return;
+        Span span;
+        span.fd = fd;
+        span.location = &location;
+        span.offset = span_start;
+        span.length = span_end - span_start;
+        uint64_t max_gap = 0;
+        for (const auto& p : pieces) max_gap = std::max(max_gap, p.gap);
+        span.hole.resize(max_gap);
+        for (const auto& p : pieces) {
+            if (p.gap > 0) span.iov.push_back({span.hole.data(), p.gap});
+            span.iov.push_back({p.target->dest, p.target->length});
+        }
+        spans.push_back(std::move(span));
+        pieces.clear();
+    };
+
+    for (const ReadTarget* t : targets) {
+        bool mergeable = !pieces.empty()
+            && t->offset >= span_end
+            && t->offset - span_end <= options.max_gap
+            && t->offset + t->length - span_start <= options.max_span
+            && pieces.size() * 2 + 2 <= IOV_MAX;
+        if (!mergeable) {
+            flush();
+            span_start = t->offset;
+            span_end = t->offset;
+        }
+        pieces.push_back({t, t->offset - span_end});
+        span_end = t->offset + t->length;
+    }
+    flush();
+}
+
+bool run_pread(const std::vector<Span>& spans, unsigned threads) {
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::mutex error_mutex;
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < spans.size() && !failed; i = next++) {
+            if (!read_span(spans[i])) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                std::cerr << "Failed to read " << spans[i].length << " bytes at offset "
+                          << spans[i].offset << " of " << *spans[i].location << ": "
+                          << std::strerror(errno) << "\n";
+                failed = true;
+            }
+        }
+    };
+
+    threads = std::max(1u, std::min<unsigned>(threads, static_cast<unsigned>(spans.size())));
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+    return !failed;
+}
+
+#ifdef HAVE_IO_URING
+// Minimal io_uring wrapper over the raw syscalls, so no liburing is needed.
+class Uring {
+public:
+    ~Uring() {
+        if (sqes_) munmap(sqes_, sqes_size_);
+        if (cq_ptr_ && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+        if (sq_ptr_) munmap(sq_ptr_, sq_size_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    bool init(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) return false;
+
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+        sq_ptr_ = map(sq_size_, IORING_OFF_SQ_RING);
+        if (!sq_ptr_) return false;
+        cq_ptr_ = single_mmap ? sq_ptr_ : map(cq_size_, IORING_OFF_CQ_RING);
+        if (!cq_ptr_) return false;
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+        if (!sqes_) return false;
+
+        char* sq = static_cast<char*>(sq_ptr_);
+        char* cq = static_cast<char*>(cq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void push_readv(int fd, const iovec* iov, unsigned count, uint64_t offset, uint64_t user_data) {
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(iov);
+        sqe->len = count;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    // Submit `to_submit` entries and wait for at least one completion.
+    bool enter(unsigned to_submit) {
+        for (;;) {
+            long r = syscall(__NR_io_uring_enter, fd_, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r >= 0) return true;
+            if (errno != EINTR) return false;
+        }
+    }
+
+    // Entries pushed that the kernel has not taken yet.
+    unsigned unsubmitted() const {
+        return *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+
+    bool pop(uint64_t& user_data, int& result) {
+        unsigned head = *cq_head_;
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    void* map(size_t size, off_t offset) {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    int fd_ = -1;
+    void* sq_ptr_ = nullptr;
+    void* cq_ptr_ = nullptr;
+    size_t sq_size_ = 0, cq_size_ = 0, sqes_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+#endif
+
+// Returns false if io_uring could not be used at all; the caller then falls
+// back to the pread pool. Spans the ring fails to complete in full are re-read
+// with preadv() right away.
+bool run_uring(const std::vector<Span>& spans, unsigned queue_depth, bool& ok) {
+#ifdef HAVE_IO_URING
+    Uring ring;
+    if (!ring.init(queue_depth)) return false;
+
+    std::vector<bool> done(spans.size(), false);
+    size_t next = 0, inflight = 0;
+    ok = true;
+
+    auto complete = [&](uint64_t index, int result) {
+        inflight--;
+        if (result >= 0 && static_cast<uint64_t>(result) == spans[index].length) {
+            done[index] = true;
+        } else if (ok && read_span(spans[index])) {
+            done[index] = true;
+        } else if (ok) {
+            std::cerr << "Failed to read " << spans[index].length << " bytes at offset "
+                      << spans[index].offset << " of " << *spans[index].location << "\n";
+            ok = false;
+        }
+    };
+
+    // Every read the kernel took is completed before returning, even after a
+    // failure: the caller frees the target buffers once we are done.
+    uint64_t index;
+    int result;
+    while ((ok && next < spans.size()) || inflight > 0) {
+        unsigned queued = 0;
+        while (ok && inflight < queue_depth && next < spans.size()) {
+            const Span& span = spans[next];
+            ring.push_readv(span.fd, span.iov.data(), static_cast<unsigned>(span.iov.size()), span.offset, next);
+            next++;
+            inflight++;
+            queued++;
+        }
+
+        if (!ring.enter(queued)) {
+            // The ring is unusable (e.g. blocked by seccomp). Wait out the
+            // reads the kernel did take by polling the completion queue,
+            // then finish the job synchronously.
+            inflight -= ring.unsubmitted();
+            while (inflight > 0) {
+                if (ring.pop(index, result)) {
+                    complete(index, result);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+            for (size_t i = 0; i < spans.size() && ok; ++i) {
+                if (!done[i]) ok = read_span(spans[i]);
+            }
+            return true;
+        }
+
+        while (ring.pop(index, result)) complete(index, result);
+    }
+    return true;
+#else
+    (void)spans;
+    (void)queue_depth;
+    (void)ok;
+    return false;
+#endif
+}
+
+} // namespace
+
+bool execute_reads(const std::string& base_dir,
+                   const std::vector<ReadTarget>& targets,
+                   const IoOptions& options,
+                   IoStats* stats) {
+    IoStats local;
+    IoStats& st = stats ? *stats : local;
+    st = IoStats{};
+    st.targets = targets.size();
+
+    // 1) Group by file, sorted by offset
+    std::map<std::string, std::vector<const ReadTarget*>> by_file;
+    for (const auto& t : targets) {
+        if (t.length == 0) continue;
+        by_file[t.location].push_back(&t);
+        st.bytes += t.length;
+    }
+    st.files = by_file.size();
+
+    // 2) Open each file once, validate the ranges and coalesce them
+    std::vector<int> fds;
+    std::vector<Span> spans;
+    bool ok = true;
+    for (auto& [location, file_targets] : by_file) {
+        int fd = open((base_dir + "/" + location).c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Failed to open external data file: " << location << "\n";
+            ok = false;
+            break;
+        }
+        fds.push_back(fd);
+
+        std::sort(file_targets.begin(), file_targets.end(),
+                  [](const ReadTarget* a, const ReadTarget* b) { return a->offset < b->offset; });
+
+        struct stat st_buf;
+        if (fstat(fd, &st_buf) == 0) {
+            uint64_t end = 0;
+            for (const ReadTarget* t : file_targets) end = std::max(end, t->offset + t->length);
+            if (end > static_cast<uint64_t>(st_buf.st_size)) {
+                std::cerr << "External data file " << location << " is " << st_buf.st_size
+                          << " bytes, but tensors reference up to byte " << end << "\n";
+                ok = false;
+                break;
+            }
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        plan_file(fd, location, file_targets, options, spans);
+    }
+    st.spans = spans.size();
+
+    // With several files (e.g. shards on different volumes), take the spans
+    // round-robin across files so every file has reads in flight at once
+    // instead of being read one after the other.
+    if (by_file.size() > 1) {
+        std::vector<std::vector<Span>> per_file;
+        for (auto& span : spans) {
+            if (per_file.empty() || per_file.back().front().fd != span.fd) per_file.emplace_back();
+            per_file.back().push_back(std::move(span));
+        }
+        spans.clear();
+        for (size_t round = 0; spans.size() < st.spans; ++round) {
+            for (auto& file_spans : per_file) {
+                if (round < file_spans.size()) spans.push_back(std::move(file_spans[round]));
+            }
+        }
+    }
+
+    // 3) Issue the reads
+    if (ok && !spans.empty()) {
+        unsigned threads = options.threads;
+        if (threads == 0) {
+            threads = std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+            // at least one reader per file
+            threads = std::max(threads, static_cast<unsigned>(std::min<size_t>(by_file.size(), 32)));
+        }
+
+        bool uring_ok = true;
+        if (options.backend == IoBackend::Uring && run_uring(spans, std::max(1u, options.queue_depth), uring_ok)) {
+            st.backend = "io_uring";
+            ok = uring_ok;
+        } else {
+            st.backend = options.backend == IoBackend::Uring ? "pread (io_uring unavailable)" : "pread";
+            ok = run_pread(spans, threads);
+        }
+    }
+
+    for (int fd : fds) close(fd);
+    return ok;
+}
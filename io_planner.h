@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Batched reader for external tensor data.
+//
+// Callers describe every tensor they need as a ReadTarget. The planner groups
+// the targets by file, sorts them by offset and coalesces neighbouring ranges
+// into large vectored reads that land directly in each target's buffer. The
+// reads are then issued either by a pool of threads calling preadv(), or
+// through io_uring when the kernel allows it (falling back to preadv
+// otherwise). Reads from several files are interleaved so that shards kept on
+// separate volumes are all read at once.
+
+enum class IoBackend {
+    Pread,  // thread pool issuing preadv()
+    Uring,  // io_uring submission queue, preadv() fallback
+};
+
+struct IoOptions {
+    IoBackend backend = IoBackend::Pread;
+    unsigned threads = 0;              // 0: one per core, capped at 8, at least one per file
+    size_t max_gap = 64 * 1024;        // largest hole read through to merge two ranges
+    size_t max_span = 16 << 20;        // largest single coalesced read
+    unsigned queue_depth = 32;         // io_uring in-flight reads
+};
+
+struct ReadTarget {
+    std::string location;  // file name relative to base_dir
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    char* dest = nullptr;  // at least `length` bytes
+};
+
+struct IoStats {
+    size_t targets = 0;
+    size_t files = 0;
+    size_t spans = 0;  // coalesced reads actually issued
+    uint64_t bytes = 0;
+    const char* backend = "pread";
+};
+
+// Read every target. Returns false (after printing the reason) if a file is
+// missing or shorter than a requested range.
+bool execute_reads(const std::string& base_dir,
+                   const std::vector<ReadTarget>& targets,
+                   const IoOptions& options,
+                   IoStats* stats = nullptr);
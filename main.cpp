@@ -4,18 +4,109 @@
 #include <numeric>   // for std::accumulate
 #include <chrono>    // for timing
 #include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <algorithm>
 #include "onnxruntime_c_api.h"
 #include <iostream>
 #include <fstream>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <tuple>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "onnx.pb.h"
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include "mapped_file.h"
+#include "batch_scheduler.h"
+#include "block_codec.h"
+#include "external_data.h"
+#include "graph_order.h"
+#include "half_convert.h"
+#include "io_planner.h"
+#include "model_cache.h"
+#include "process_stats.h"
+#include "startup_trace.h"
+#include "tensor_index.h"
+#include "weight_verifier.h"
 
 // Global variables
 static void* g_handle = nullptr;
 static const OrtApi* g_ort_api = nullptr;
 static OrtEnv* g_env = nullptr;
+static std::string g_ort_version;
+
+// Number of operator new calls made by the whole process so far, in every
+// form: plain, array, nothrow and aligned. Sample it before and after a
+// phase to see how many heap allocations the phase made.
+static std::atomic<size_t> g_heap_allocs{0};
+
+namespace {
+
+void* counted_alloc(size_t size, size_t alignment) noexcept {
+    g_heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+    void* ptr = nullptr;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+}
+
+void* counted_alloc_or_throw(size_t size, size_t alignment) {
+    if (void* ptr = counted_alloc(size, alignment)) return ptr;
+    throw std::bad_alloc();
+}
+
+} // namespace
+
+// Kept out of line: once inlined, g++ sees std::free called on what the
+// standard operator new returned and warns (-Wmismatched-new-delete).
+#define COUNTED_NEW [[gnu::noinline]]
+COUNTED_NEW void* operator new(size_t size) { return counted_alloc_or_throw(size, 0); }
+COUNTED_NEW void* operator new[](size_t size) { return counted_alloc_or_throw(size, 0); }
+COUNTED_NEW void* operator new(size_t size, const std::nothrow_t&) noexcept { return counted_alloc(size, 0); }
+COUNTED_NEW void* operator new[](size_t size, const std::nothrow_t&) noexcept { return counted_alloc(size, 0); }
+COUNTED_NEW void* operator new(size_t size, std::align_val_t alignment) {
+    return counted_alloc_or_throw(size, static_cast<size_t>(alignment));
+}
+COUNTED_NEW void* operator new[](size_t size, std::align_val_t alignment) {
+    return counted_alloc_or_throw(size, static_cast<size_t>(alignment));
+}
+COUNTED_NEW void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, static_cast<size_t>(alignment));
+}
+COUNTED_NEW void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, static_cast<size_t>(alignment));
+}
+
+COUNTED_NEW void operator delete(void* ptr) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete[](void* ptr) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete(void* ptr, size_t, std::align_val_t) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+COUNTED_NEW void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+#undef COUNTED_NEW
 
 //------------------------------------------------------------------------------
 // 1) Initialize the runtime by dynamically loading the ONNX Runtime library
@@ -38,6 +129,7 @@ bool initRuntime(const char* lib_path) {
             return false;
         }
         const OrtApiBase* api_base = OrtGetApiBase();
+        g_ort_version = api_base->GetVersionString();
         g_ort_api = api_base->GetApi(ORT_API_VERSION);
         if (!g_ort_api) {
             std::cerr << "Failed to retrieve OrtApi." << std::endl;
@@ -329,15 +421,521 @@ std::vector<float> runInference(
     return logits; // either empty or [neg_logit, pos_logit]
 }
 
-struct AutoTime {
-  AutoTime(const char* str)
-  :start(std::chrono::high_resolution_clock::now())
-  , str(str) { }
-  ~AutoTime() {
-    printf("%s: %0.02lfms\n", str, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()-start).count());
-  }
-  std::chrono::time_point<std::chrono::high_resolution_clock> start;
-  const char* str;
+//------------------------------------------------------------------------------
+// 5b) Reusable inference context
+//
+// runInference creates and releases a memory info, the input shape, the name
+// arrays, the input tensors and the result vector on every call. A context
+// builds them once for one session and one thread. Its input tensors wrap
+// buffers of its own and are only rebuilt when the sequence length changes,
+// so a steady-state run() copies the tokens in and calls Run without a heap
+// allocation on our side. ORT still allocates the output tensor.
+//------------------------------------------------------------------------------
+// Print and release a failed status. True if `status` is a success.
+bool checkStatus(OrtStatus* status, const char* what) {
+    if (status == nullptr) return true;
+    std::cerr << what << " failed: " << g_ort_api->GetErrorMessage(status) << std::endl;
+    g_ort_api->ReleaseStatus(status);
+    return false;
+}
+
+class InferenceContext {
+public:
+    InferenceContext() = default;
+    ~InferenceContext() { release(); }
+
+    InferenceContext(const InferenceContext&) = delete;
+    InferenceContext& operator=(const InferenceContext&) = delete;
+
+    bool init(OrtSession* session,
+              const std::vector<std::string>& input_names,
+              const std::vector<std::string>& output_names) {
+        release();
+        if (!session || input_names.size() < 2 || output_names.empty()) {
+            std::cerr << "InferenceContext: expected a session with 2 inputs and an output.\n";
+            return false;
+        }
+        session_ = session;
+        names_[0] = input_names[0];
+        names_[1] = input_names[1];
+        names_[2] = output_names[0];
+        input_names_[0] = names_[0].c_str();
+        input_names_[1] = names_[1].c_str();
+        output_names_[0] = names_[2].c_str();
+
+        OrtStatus* status = g_ort_api->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, &memory_info_);
+        if (status == nullptr) status = g_ort_api->CreateRunOptions(&run_options_);
+        return checkStatus(status, "InferenceContext init");
+    }
+
+    // The [negative, positive] logits for `length` tokens, valid until the
+    // next run, or nullptr on failure.
+    const float* run(const int64_t* input_ids, const int64_t* attention_mask, size_t length) {
+        if (!session_ || !bindInputs(length)) return nullptr;
+        std::copy(input_ids, input_ids + length, input_ids_.begin());
+        std::copy(attention_mask, attention_mask + length, attention_mask_.begin());
+
+        OrtValue* output_tensor = nullptr;
+        if (!checkStatus(g_ort_api->Run(session_, run_options_, input_names_, inputs_, 2,
+                                        output_names_, 1, &output_tensor), "Session Run")) {
+            return nullptr;
+        }
+        float* output_data = nullptr;
+        bool ok = checkStatus(g_ort_api->GetTensorMutableData(output_tensor, (void**)&output_data),
+                              "GetTensorMutableData");
+        if (ok) {
+            logits_[0] = output_data[0];
+            logits_[1] = output_data[1];
+        }
+        g_ort_api->ReleaseValue(output_tensor);
+        return ok ? logits_ : nullptr;
+    }
+
+private:
+    // Point the input tensors at the first `length` tokens of the buffers,
+    // growing them if needed.
+    bool bindInputs(size_t length) {
+        if (inputs_[0] && shape_[1] == static_cast<int64_t>(length)) return true;
+        releaseInputs();
+        if (input_ids_.size() < length) {
+            input_ids_.resize(length);
+            attention_mask_.resize(length);
+        }
+        shape_[1] = static_cast<int64_t>(length);
+        int64_t* buffers[2] = {input_ids_.data(), attention_mask_.data()};
+        for (int i = 0; i < 2; ++i) {
+            OrtValue* value = nullptr;
+            if (!checkStatus(g_ort_api->CreateTensorWithDataAsOrtValue(
+                                 memory_info_, buffers[i], length * sizeof(int64_t), shape_, 2,
+                                 ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64, &value),
+                             "CreateTensorWithDataAsOrtValue")) {
+                releaseInputs();
+                return false;
+            }
+            inputs_[i] = value;
+        }
+        return true;
+    }
+
+    void releaseInputs() {
+        for (auto*& value : inputs_) {
+            if (value) g_ort_api->ReleaseValue(const_cast<OrtValue*>(value));
+            value = nullptr;
+        }
+    }
+
+    void release() {
+        releaseInputs();
+        if (run_options_) g_ort_api->ReleaseRunOptions(run_options_);
+        if (memory_info_) g_ort_api->ReleaseMemoryInfo(memory_info_);
+        run_options_ = nullptr;
+        memory_info_ = nullptr;
+        session_ = nullptr;
+    }
+
+    OrtSession* session_ = nullptr;
+    OrtMemoryInfo* memory_info_ = nullptr;
+    OrtRunOptions* run_options_ = nullptr;
+    std::string names_[3];
+    const char* input_names_[2] = {};
+    const char* output_names_[1] = {};
+    std::vector<int64_t> input_ids_, attention_mask_;
+    const OrtValue* inputs_[2] = {};
+    int64_t shape_[2] = {1, 0};
+    float logits_[2] = {};
+};
+
+//------------------------------------------------------------------------------
+// 5c) IoBinding context
+//
+// Even through a context, Run hands back an output tensor ORT allocated for
+// the call. A binding context keeps buffers of its own for every
+// [batch, sequence] shape it has run, plus an OrtIoBinding bound to them.
+// Callers write the tokens straight into the bound inputs, and
+// RunWithBinding writes the logits straight into the bound output. A
+// steady-state run neither allocates an output nor copies one out. At most
+// kMaxShapes shapes stay bound; past that the least recently run is freed.
+//------------------------------------------------------------------------------
+class BindingContext {
+public:
+    // Buffers and binding for one input shape.
+    struct Shape {
+        int64_t batch = 0;
+        int64_t length = 0;
+        std::vector<int64_t> input_ids;       // [batch, length]
+        std::vector<int64_t> attention_mask;  // [batch, length]
+        std::vector<float> logits;            // [batch, labels]
+        OrtValue* values[3] = {};
+        OrtIoBinding* binding = nullptr;
+        uint64_t used = 0;  // when it was last asked for
+    };
+
+    static constexpr size_t kMaxShapes = 64;
+
+    BindingContext() = default;
+    ~BindingContext() { release(); }
+
+    BindingContext(const BindingContext&) = delete;
+    BindingContext& operator=(const BindingContext&) = delete;
+
+    // Reads the number of labels from the output's type, which must be a
+    // float [batch, labels] tensor.
+    bool init(OrtSession* session,
+              const std::vector<std::string>& input_names,
+              const std::vector<std::string>& output_names) {
+        release();
+        if (!session || input_names.size() < 2 || output_names.empty()) {
+            std::cerr << "BindingContext: expected a session with 2 inputs and an output.\n";
+            return false;
+        }
+        session_ = session;
+        names_[0] = input_names[0];
+        names_[1] = input_names[1];
+        names_[2] = output_names[0];
+
+        OrtTypeInfo* type_info = nullptr;
+        const OrtTensorTypeAndShapeInfo* tensor_info = nullptr;
+        ONNXTensorElementDataType type = ONNX_TENSOR_ELEMENT_DATA_TYPE_UNDEFINED;
+        size_t rank = 0;
+        int64_t dims[2] = {0, 0};
+        bool ok = checkStatus(g_ort_api->SessionGetOutputTypeInfo(session, 0, &type_info), "SessionGetOutputTypeInfo")
+            && checkStatus(g_ort_api->CastTypeInfoToTensorInfo(type_info, &tensor_info), "CastTypeInfoToTensorInfo")
+            && checkStatus(g_ort_api->GetTensorElementType(tensor_info, &type), "GetTensorElementType")
+            && checkStatus(g_ort_api->GetDimensionsCount(tensor_info, &rank), "GetDimensionsCount")
+            && rank == 2 && checkStatus(g_ort_api->GetDimensions(tensor_info, dims, 2), "GetDimensions");
+        if (type_info) g_ort_api->ReleaseTypeInfo(type_info);
+        if (!ok || type != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || dims[1] <= 0) {
+            std::cerr << "BindingContext: " << names_[2] << " is not a float [batch, labels] tensor.\n";
+            return false;
+        }
+        labels_ = dims[1];
+
+        return checkStatus(g_ort_api->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, &memory_info_),
+                           "CreateCpuMemoryInfo")
+            && checkStatus(g_ort_api->CreateRunOptions(&run_options_), "CreateRunOptions");
+    }
+
+    int64_t labels() const { return labels_; }
+    size_t shapes() const { return shapes_.size(); }
+
+    // The buffers for a [batch, length] run, allocated and bound the first
+    // time the shape is asked for. nullptr on failure. Binding a new shape
+    // may free the least recently used one, so only the last shape returned
+    // stays valid.
+    Shape* shape(int64_t batch, int64_t length) {
+        if (last_ && last_->batch == batch && last_->length == length) {
+            last_->used = ++uses_;
+            return last_;
+        }
+        auto it = shapes_.find({batch, length});
+        if (it != shapes_.end()) {
+            last_ = it->second.get();
+            last_->used = ++uses_;
+            return last_;
+        }
+
+        if (shapes_.size() >= kMaxShapes) {
+            auto oldest = shapes_.begin();
+            for (auto entry = shapes_.begin(); entry != shapes_.end(); ++entry) {
+                if (entry->second->used < oldest->second->used) oldest = entry;
+            }
+            if (oldest->second.get() == last_) last_ = nullptr;
+            releaseShape(*oldest->second);
+            shapes_.erase(oldest);
+        }
+
+        std::unique_ptr<Shape> shape(new Shape);
+        shape->batch = batch;
+        shape->length = length;
+        shape->input_ids.resize(batch * length);
+        shape->attention_mask.resize(batch * length);
+        shape->logits.resize(batch * labels_);
+        if (!bind(*shape)) {
+            releaseShape(*shape);
+            return nullptr;
+        }
+        shape->used = ++uses_;
+        last_ = shape.get();
+        shapes_.emplace(std::make_pair(batch, length), std::move(shape));
+        return last_;
+    }
+
+    // Run on the inputs written into `shape`; the logits land in
+    // shape.logits.
+    bool run(Shape& shape) {
+        return checkStatus(g_ort_api->RunWithBinding(session_, run_options_, shape.binding), "RunWithBinding");
+    }
+
+    // Batch of one: copy the tokens in and return the logits, valid until
+    // the next run of the same length, or nullptr on failure.
+    const float* run(const int64_t* input_ids, const int64_t* attention_mask, size_t length) {
+        Shape* bound = shape(1, static_cast<int64_t>(length));
+        if (!bound) return nullptr;
+        std::copy(input_ids, input_ids + length, bound->input_ids.begin());
+        std::copy(attention_mask, attention_mask + length, bound->attention_mask.begin());
+        return run(*bound) ? bound->logits.data() : nullptr;
+    }
+
+private:
+    bool bind(Shape& shape) {
+        int64_t input_shape[2] = {shape.batch, shape.length};
+        int64_t output_shape[2] = {shape.batch, labels_};
+        size_t input_bytes = shape.input_ids.size() * sizeof(int64_t);
+        return checkStatus(g_ort_api->CreateTensorWithDataAsOrtValue(
+                               memory_info_, shape.input_ids.data(), input_bytes, input_shape, 2,
+                               ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64, &shape.values[0]),
+                           "CreateTensorWithDataAsOrtValue(input_ids)")
+            && checkStatus(g_ort_api->CreateTensorWithDataAsOrtValue(
+                               memory_info_, shape.attention_mask.data(), input_bytes, input_shape, 2,
+                               ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64, &shape.values[1]),
+                           "CreateTensorWithDataAsOrtValue(attention_mask)")
+            && checkStatus(g_ort_api->CreateTensorWithDataAsOrtValue(
+                               memory_info_, shape.logits.data(), shape.logits.size() * sizeof(float),
+                               output_shape, 2, ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT, &shape.values[2]),
+                           "CreateTensorWithDataAsOrtValue(logits)")
+            && checkStatus(g_ort_api->CreateIoBinding(session_, &shape.binding), "CreateIoBinding")
+            && checkStatus(g_ort_api->BindInput(shape.binding, names_[0].c_str(), shape.values[0]), "BindInput")
+            && checkStatus(g_ort_api->BindInput(shape.binding, names_[1].c_str(), shape.values[1]), "BindInput")
+            && checkStatus(g_ort_api->BindOutput(shape.binding, names_[2].c_str(), shape.values[2]), "BindOutput");
+    }
+
+    void releaseShape(Shape& shape) {
+        if (shape.binding) g_ort_api->ReleaseIoBinding(shape.binding);
+        shape.binding = nullptr;
+        for (auto*& value : shape.values) {
+            if (value) g_ort_api->ReleaseValue(value);
+            value = nullptr;
+        }
+    }
+
+    void release() {
+        for (auto& entry : shapes_) releaseShape(*entry.second);
+        shapes_.clear();
+        last_ = nullptr;
+        if (run_options_) g_ort_api->ReleaseRunOptions(run_options_);
+        if (memory_info_) g_ort_api->ReleaseMemoryInfo(memory_info_);
+        run_options_ = nullptr;
+        memory_info_ = nullptr;
+        session_ = nullptr;
+    }
+
+    OrtSession* session_ = nullptr;
+    OrtMemoryInfo* memory_info_ = nullptr;
+    OrtRunOptions* run_options_ = nullptr;
+    std::string names_[3];
+    int64_t labels_ = 0;
+    std::map<std::pair<int64_t, int64_t>, std::unique_ptr<Shape>> shapes_;
+    Shape* last_ = nullptr;
+    uint64_t uses_ = 0;
+};
+
+enum class RunMode {
+    Plain,    // runInference: build every input and name array per call
+    Context,  // InferenceContext: build them once, reuse them every run
+    Binding,  // BindingContext: bound buffers per shape, no output allocation
+};
+
+const char* runModeName(RunMode mode) {
+    return mode == RunMode::Plain ? "plain" : mode == RunMode::Context ? "context" : "binding";
+}
+
+// The benchmark's inference path, as chosen with --run.
+class Runner {
+public:
+    bool init(RunMode mode, OrtSession* session,
+              const std::vector<std::string>& input_names,
+              const std::vector<std::string>& output_names) {
+        mode_ = mode;
+        session_ = session;
+        input_names_ = &input_names;
+        output_names_ = &output_names;
+        if (mode == RunMode::Context) return context_.init(session, input_names, output_names);
+        if (mode == RunMode::Binding) return binding_.init(session, input_names, output_names);
+        return true;
+    }
+
+    // The [negative, positive] logits, valid until the next run, or nullptr.
+    const float* run(const std::vector<int64_t>& input_ids, const std::vector<int64_t>& attention_mask) {
+        switch (mode_) {
+        case RunMode::Context:
+            return context_.run(input_ids.data(), attention_mask.data(), input_ids.size());
+        case RunMode::Binding:
+            return binding_.run(input_ids.data(), attention_mask.data(), input_ids.size());
+        default:
+            result_ = runInference(session_, *input_names_, *output_names_, input_ids, attention_mask);
+            return result_.empty() ? nullptr : result_.data();
+        }
+    }
+
+private:
+    RunMode mode_ = RunMode::Plain;
+    OrtSession* session_ = nullptr;
+    const std::vector<std::string>* input_names_ = nullptr;
+    const std::vector<std::string>* output_names_ = nullptr;
+    InferenceContext context_;
+    BindingContext binding_;
+    std::vector<float> result_;
+};
+
+//------------------------------------------------------------------------------
+// 5d) Async context
+//
+// The paths above block the caller for the whole run. An async context starts
+// each run with RunAsync instead. ORT runs it on a thread of the session's
+// intra-op pool and calls back when it is done, so the caller can prepare
+// the next request or finish the previous one in the meantime. ORT refuses
+// RunAsync on a session with fewer than two intra-op threads.
+//------------------------------------------------------------------------------
+class AsyncContext {
+public:
+    // Called on an ORT thread with the [negative, positive] logits, or with
+    // none if the run failed.
+    using Callback = std::function<void(std::vector<float> logits)>;
+
+    AsyncContext() = default;
+    ~AsyncContext() {
+        wait();
+        release();
+    }
+
+    AsyncContext(const AsyncContext&) = delete;
+    AsyncContext& operator=(const AsyncContext&) = delete;
+
+    bool init(OrtSession* session,
+              const std::vector<std::string>& input_names,
+              const std::vector<std::string>& output_names) {
+        wait();
+        release();
+        if (!session || input_names.size() < 2 || output_names.empty()) {
+            std::cerr << "AsyncContext: expected a session with 2 inputs and an output.\n";
+            return false;
+        }
+        session_ = session;
+        names_[0] = input_names[0];
+        names_[1] = input_names[1];
+        names_[2] = output_names[0];
+        input_names_[0] = names_[0].c_str();
+        input_names_[1] = names_[1].c_str();
+        output_names_[0] = names_[2].c_str();
+
+        OrtStatus* status = g_ort_api->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, &memory_info_);
+        if (status == nullptr) status = g_ort_api->CreateRunOptions(&run_options_);
+        return checkStatus(status, "AsyncContext init");
+    }
+
+    // Start a run. The tokens are kept until it completes. Returns false if
+    // the run could not be started, and `done` is then never called.
+    bool submit(std::vector<int64_t> input_ids, std::vector<int64_t> attention_mask, Callback done) {
+        if (!session_ || input_ids.empty() || input_ids.size() != attention_mask.size()) return false;
+        std::unique_ptr<Request> request(new Request);
+        request->context = this;
+        request->input_ids = std::move(input_ids);
+        request->attention_mask = std::move(attention_mask);
+        request->shape[1] = static_cast<int64_t>(request->input_ids.size());
+        request->done = std::move(done);
+        int64_t* buffers[2] = {request->input_ids.data(), request->attention_mask.data()};
+        for (int i = 0; i < 2; ++i) {
+            if (!checkStatus(g_ort_api->CreateTensorWithDataAsOrtValue(
+                                 memory_info_, buffers[i], request->input_ids.size() * sizeof(int64_t),
+                                 request->shape, 2, ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64, &request->inputs[i]),
+                             "CreateTensorWithDataAsOrtValue")) {
+                releaseValues(*request);
+                return false;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            in_flight_++;
+        }
+        const OrtValue* inputs[2] = {request->inputs[0], request->inputs[1]};
+        Request* started = request.get();
+        if (!checkStatus(g_ort_api->RunAsync(session_, run_options_, input_names_, inputs, 2,
+                                             output_names_, 1, &started->output, complete, started),
+                         "RunAsync")) {
+            releaseValues(*request);
+            finished();
+            return false;
+        }
+        request.release();  // complete() owns it now
+        return true;
+    }
+
+    // Same, with the logits delivered through a future. It holds none if
+    // the run failed or could not be started.
+    std::future<std::vector<float>> submit(std::vector<int64_t> input_ids, std::vector<int64_t> attention_mask) {
+        auto result = std::make_shared<std::promise<std::vector<float>>>();
+        std::future<std::vector<float>> future = result->get_future();
+        if (!submit(std::move(input_ids), std::move(attention_mask),
+                    [result](std::vector<float> logits) { result->set_value(std::move(logits)); })) {
+            result->set_value({});
+        }
+        return future;
+    }
+
+    // Block until every run started so far has called back.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]() { return in_flight_ == 0; });
+    }
+
+private:
+    // One run in flight, with everything ORT reads or writes until it calls
+    // back.
+    struct Request {
+        AsyncContext* context = nullptr;
+        std::vector<int64_t> input_ids, attention_mask;
+        int64_t shape[2] = {1, 0};
+        OrtValue* inputs[2] = {};
+        OrtValue* output = nullptr;
+        Callback done;
+    };
+
+    static void complete(void* user_data, OrtValue** outputs, size_t num_outputs, OrtStatusPtr status) {
+        std::unique_ptr<Request> request(static_cast<Request*>(user_data));
+        std::vector<float> logits;
+        float* output_data = nullptr;
+        if (checkStatus(status, "RunAsync callback") && num_outputs == 1 && outputs[0]
+            && checkStatus(g_ort_api->GetTensorMutableData(outputs[0], (void**)&output_data),
+                           "GetTensorMutableData")) {
+            logits.assign(output_data, output_data + 2);
+        }
+        releaseValues(*request);
+        request->done(std::move(logits));
+        request->context->finished();
+    }
+
+    static void releaseValues(Request& request) {
+        for (auto*& value : request.inputs) {
+            if (value) g_ort_api->ReleaseValue(value);
+            value = nullptr;
+        }
+        if (request.output) g_ort_api->ReleaseValue(request.output);
+        request.output = nullptr;
+    }
+
+    void finished() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--in_flight_ == 0) idle_.notify_all();
+    }
+
+    void release() {
+        if (run_options_) g_ort_api->ReleaseRunOptions(run_options_);
+        if (memory_info_) g_ort_api->ReleaseMemoryInfo(memory_info_);
+        run_options_ = nullptr;
+        memory_info_ = nullptr;
+        session_ = nullptr;
+    }
+
+    OrtSession* session_ = nullptr;
+    OrtMemoryInfo* memory_info_ = nullptr;
+    OrtRunOptions* run_options_ = nullptr;
+    std::string names_[3];
+    const char* input_names_[2] = {};
+    const char* output_names_[1] = {};
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    size_t in_flight_ = 0;
 };
 
 bool loadFileToBuffer(const std::string& path, std::vector<char>& buffer) {
@@ -349,86 +947,1633 @@ bool loadFileToBuffer(const std::string& path, std::vector<char>& buffer) {
     return file.read(buffer.data(), size).good();
 }
 
-bool load_external_data_for_model(onnx::ModelProto& model, const std::string& base_dir) {
+// Parse an mmapped graph.onnx into messages owned by `arena`. Every NodeProto,
+// TensorProto and string lands in a few large arena blocks instead of its own
+// heap allocation, and the whole graph is freed at once with the arena.
+onnx::ModelProto* parse_model_on_arena(const MappedFile& file, google::protobuf::Arena* arena) {
+    auto* model = google::protobuf::Arena::CreateMessage<onnx::ModelProto>(arena);
+    google::protobuf::io::ArrayInputStream stream(file.data(), static_cast<int>(file.size()));
+    if (!model->ParseFromZeroCopyStream(&stream)) return nullptr;
+    return model;
+}
+
+// A float tensor whose fp16/bf16 values were read into the upper half of
+// its buffer.
+struct WidenJob {
+    char* buffer;
+    size_t count;
+};
+
+void widen_loaded_tensors(const std::vector<WidenJob>& jobs, const std::string& storage) {
+    if (jobs.empty()) return;
+    auto begin = std::chrono::high_resolution_clock::now();
+    uint64_t bytes = 0;
+    for (const auto& job : jobs) {
+        widen_in_place(job.buffer, job.count, storage == "bf16");
+        bytes += job.count * sizeof(float);
+    }
+    printf("widening weights: %zu tensors from %s to %.1f MiB of float with %s in %0.02lfms\n",
+           jobs.size(), storage.c_str(), bytes / (1024.0 * 1024.0),
+           storage == "bf16" ? "avx2/scalar" : half_convert_implementation(),
+           std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - begin).count());
+}
+
+// Block-compressed tensors are read into staging buffers of their own, then
+// decompressed in parallel straight into their final place once every read
+// has landed.
+class CompressedWeights {
+public:
+    // Returns where to read the stored bytes of the tensor that decompresses
+    // to `dest`, or nullptr if its layout is malformed.
+    char* stage(const std::string& name, const ExternalDataInfo& info, char* dest) {
+        BlockLayout layout;
+        layout.block_size = info.block_size;
+        layout.raw_length = info.raw_length;
+        if (!parse_codec_name(info.compression, layout) || !parse_block_sizes(info.blocks, layout.blocks)
+            || layout.block_size == 0 || stored_length(layout) != info.length
+            || layout.blocks.size() != (layout.raw_length + layout.block_size - 1) / layout.block_size) {
+            std::cerr << "Bad compression layout for tensor " << name << ": " << info.compression << "\n";
+            return nullptr;
+        }
+        layouts_.push_back(std::move(layout));
+        names_.push_back(name);
+        staging_.emplace_back(new char[info.length]);
+        targets_.push_back({&layouts_.back(), staging_.back().get(), dest, &names_.back()});
+        return staging_.back().get();
+    }
+
+    bool decompress(unsigned threads) {
+        if (targets_.empty()) return true;
+        DecodeStats stats;
+        bool ok = decompress_blocks(targets_, threads, &stats);
+        printf("decompressing weights: %zu tensors, %zu blocks, %.1f MiB -> %.1f MiB on %u threads"
+               " in %0.02lfms (%.0f MiB/s)\n",
+               stats.tensors, stats.blocks, stats.stored_bytes / (1024.0 * 1024.0),
+               stats.raw_bytes / (1024.0 * 1024.0), stats.threads, stats.elapsed_ms,
+               stats.elapsed_ms > 0 ? stats.raw_bytes / (1024.0 * 1024.0) / (stats.elapsed_ms / 1000.0) : 0.0);
+        staging_.clear();
+        return ok;
+    }
+
+private:
+    std::deque<BlockLayout> layouts_;
+    std::deque<std::string> names_;
+    std::vector<std::unique_ptr<char[]>> staging_;
+    std::vector<DecodeTarget> targets_;
+};
+
+// Read the external payload of each of `candidates` into its raw_data.
+bool load_external_tensors(const std::vector<onnx::TensorProto*>& candidates, const std::string& storage,
+                           const std::string& base_dir, const IoOptions& io_options) {
+    // Size every raw_data buffer up front, then let the planner coalesce the
+    // reads and scatter them straight into those buffers.
+    // 16-bit float storage is read into the upper half of the float buffer
+    // and widened in place; compressed tensors decompress into that half.
+    std::vector<onnx::TensorProto*> tensors;
+    std::vector<ReadTarget> targets;
+    std::vector<WidenJob> widen_jobs;
+    CompressedWeights compressed;
+    for (onnx::TensorProto* candidate : candidates) {
+        onnx::TensorProto& tensor = *candidate;
+        if (tensor.data_location() != onnx::TensorProto_DataLocation_EXTERNAL) continue;
+
+        ExternalDataInfo info = get_external_data_info(tensor);
+        uint64_t length = decoded_length(info);
+        bool widen = !storage.empty() && tensor.data_type() == onnx::TensorProto_DataType_FLOAT;
+        std::string* raw_data = tensor.mutable_raw_data();
+        raw_data->resize(widen ? length * 2 : length);
+        char* dest = &(*raw_data)[0] + (widen ? length : 0);
+        if (!info.compression.empty() && !(dest = compressed.stage(tensor.name(), info, dest))) {
+            return false;
+        }
+        tensors.push_back(&tensor);
+        targets.push_back({info.location, info.offset, info.length, dest});
+        if (widen) widen_jobs.push_back({&(*raw_data)[0], length / 2});
+    }
+
+    if (targets.empty()) return true;
+
+    IoStats stats;
+    if (!execute_reads(base_dir, targets, io_options, &stats)) return false;
+    printf("loading weights: %zu tensors, %zu file(s), %zu read(s), %.1f MiB via %s\n",
+           stats.targets, stats.files, stats.spans, stats.bytes / (1024.0 * 1024.0), stats.backend);
+    if (!compressed.decompress(io_options.threads)) return false;
+    widen_loaded_tensors(widen_jobs, storage);
+
+    for (auto* tensor : tensors) {
+        tensor->set_data_location(onnx::TensorProto_DataLocation_DEFAULT);
+        tensor->clear_external_data();
+    }
+    return true;
+}
+
+bool load_external_data_for_model(onnx::ModelProto& model, const std::string& base_dir,
+                                  const IoOptions& io_options) {
+    return load_external_tensors(model_tensors(model), external_float_storage(model), base_dir, io_options);
+}
+
+// Serialize `model` with every external initializer inlined, reading the
+// weights straight into their final place in `out`. With
+// load_external_data_for_model + SerializeAsString the weights exist twice,
+// once in raw_data and once in the serialized copy; here they only ever
+// exist in `out`.
+//
+// The initializers are moved into a second GraphProto record appended after
+// the rest of the model. Protobuf merges repeated occurrences of a message
+// field, so ORT parses the two graph records as a single graph. External
+// tensors found anywhere else (sparse initializers, Constant nodes,
+// subgraphs) are loaded into raw_data first and serialized with the rest.
+bool serialize_with_external_data(onnx::ModelProto& model, const std::string& base_dir,
+                                  const IoOptions& io_options, std::string& out) {
+    using google::protobuf::io::CodedOutputStream;
+
+    std::vector<onnx::TensorProto*> nested = model_tensors(model);
+    nested.erase(nested.begin(), nested.begin() + model.graph().initializer_size());
+    if (!load_external_tensors(nested, external_float_storage(model), base_dir, io_options)) return false;
+
+    // 1) Serialize each initializer without its payload
+    struct Piece {
+        std::string header;    // the tensor without raw_data
+        std::string name;
+        uint64_t size;         // serialized size once raw_data is appended
+        ExternalDataInfo external;
+        uint64_t payload;      // raw_data length, twice the decoded length when widened
+        bool is_external;
+        bool widen;
+    };
+    std::string storage = external_float_storage(model);
+    std::vector<Piece> pieces;
     for (auto& tensor : *model.mutable_graph()->mutable_initializer()) {
+        Piece piece;
+        piece.name = tensor.name();
+        piece.is_external = tensor.data_location() == onnx::TensorProto_DataLocation_EXTERNAL;
+        piece.widen = piece.is_external && !storage.empty()
+            && tensor.data_type() == onnx::TensorProto_DataType_FLOAT;
+        if (piece.is_external) {
+            piece.external = get_external_data_info(tensor);
+            uint64_t length = decoded_length(piece.external);
+            piece.payload = piece.widen ? length * 2 : length;
+            tensor.clear_external_data();
+            tensor.set_data_location(onnx::TensorProto_DataLocation_DEFAULT);
+        }
+        piece.header = tensor.SerializeAsString();
+        piece.size = piece.header.size();
+        if (piece.is_external) {
+            piece.size += 1 + CodedOutputStream::VarintSize64(piece.payload) + piece.payload;
+        }
+        pieces.push_back(std::move(piece));
+    }
+
+    // 2) Serialize everything else
+    model.mutable_graph()->clear_initializer();
+    std::string head = model.SerializeAsString();
+
+    // 3) Lay out: head, then graph { initializer* } with payloads read in place
+    uint64_t graph_size = 0;
+    for (const auto& piece : pieces) {
+        graph_size += 1 + CodedOutputStream::VarintSize64(piece.size) + piece.size;
+    }
+    out.clear();
+    out.resize(head.size() + 1 + CodedOutputStream::VarintSize64(graph_size) + graph_size);
+
+    uint8_t* p = reinterpret_cast<uint8_t*>(&out[0]);
+    p = std::copy(head.begin(), head.end(), p);
+    p = CodedOutputStream::WriteTagToArray(onnx::ModelProto::kGraphFieldNumber << 3 | 2, p);
+    p = CodedOutputStream::WriteVarint64ToArray(graph_size, p);
+
+    std::vector<ReadTarget> targets;
+    std::vector<WidenJob> widen_jobs;
+    CompressedWeights compressed;
+    for (const auto& piece : pieces) {
+        p = CodedOutputStream::WriteTagToArray(onnx::GraphProto::kInitializerFieldNumber << 3 | 2, p);
+        p = CodedOutputStream::WriteVarint64ToArray(piece.size, p);
+        p = std::copy(piece.header.begin(), piece.header.end(), p);
+        if (!piece.is_external) continue;
+
+        p = CodedOutputStream::WriteTagToArray(onnx::TensorProto::kRawDataFieldNumber << 3 | 2, p);
+        p = CodedOutputStream::WriteVarint64ToArray(piece.payload, p);
+        char* buffer = reinterpret_cast<char*>(p);
+        uint64_t length = decoded_length(piece.external);
+        char* dest = buffer + (piece.payload - length);
+        if (!piece.external.compression.empty()
+            && !(dest = compressed.stage(piece.name, piece.external, dest))) {
+            return false;
+        }
+        targets.push_back({piece.external.location, piece.external.offset, piece.external.length, dest});
+        if (piece.widen) widen_jobs.push_back({buffer, length / 2});
+        p += piece.payload;
+    }
+
+    IoStats stats;
+    if (!execute_reads(base_dir, targets, io_options, &stats)) return false;
+    printf("loading weights: %zu tensors, %zu file(s), %zu read(s), %.1f MiB via %s\n",
+           stats.targets, stats.files, stats.spans, stats.bytes / (1024.0 * 1024.0), stats.backend);
+    if (!compressed.decompress(io_options.threads)) return false;
+    widen_loaded_tensors(widen_jobs, storage);
+    return true;
+}
+
+// Drop the external data files from the page cache, so the next load reads
+// them from storage. Lets cold loads be benchmarked without root.
+void evict_external_data(const onnx::ModelProto& model, const std::string& base_dir) {
+    for (const auto& location : external_data_locations(model)) {
+        int fd = open((base_dir + "/" + location).c_str(), O_RDONLY);
+        if (fd < 0) continue;
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+    }
+}
+
+// Map every external data file referenced by the graph and hand ORT each
+// initializer as a tensor over its mapped bytes. The initializers keep their
+// external_data entries, which AddExternalInitializers requires of the
+// tensors it replaces. ORT references the buffers of user-provided
+// initializers instead of copying them, so the weights are served from the
+// page cache, shared by every process that maps the same file, and the
+// mappings must outlive the sessions. When split aligned the tensors, the
+// mappings are aligned the same way so each tensor is aligned in memory too.
+// Initializers of subgraphs are left to ORT, which reads them from the files.
+bool add_mapped_external_data(const onnx::ModelProto& model,
+                              const std::string& base_dir,
+                              OrtSessionOptions* session_options,
+                              std::map<std::string, MappedFile>& files) {
+    if (!external_float_storage(model).empty()) {
+        std::cerr << "weights are stored as " << external_float_storage(model)
+                  << " for widening on load, which ORT cannot do on mapped files: use --load=inline"
+                  << " or --load=lowpeak, or re-run split with --widen=cast\n";
+        return false;
+    }
+    if (has_compressed_external_data(model)) {
+        std::cerr << "weights are block-compressed, which ORT cannot read from mapped files:"
+                  << " use --load=inline or --load=lowpeak, or re-run split without --compress\n";
+        return false;
+    }
+
+    size_t alignment = external_data_alignment(model);
+    for (const auto& location : external_data_locations(model)) {
+        MappedFile file;
+        if (!file.open(base_dir + "/" + location, alignment)) {
+            std::cerr << "Failed to map external data file: " << location << "\n";
+            return false;
+        }
+        files.emplace(location, std::move(file));
+    }
+    if (files.empty()) return true;
+
+    OrtMemoryInfo* memory_info = nullptr;
+    if (!checkStatus(g_ort_api->CreateCpuMemoryInfo(OrtDeviceAllocator, OrtMemTypeDefault, &memory_info),
+                     "CreateCpuMemoryInfo")) {
+        return false;
+    }
+    std::vector<const char*> names;
+    std::vector<OrtValue*> values;
+    auto release_values = [&]() {
+        for (auto* value : values) g_ort_api->ReleaseValue(value);
+        g_ort_api->ReleaseMemoryInfo(memory_info);
+    };
+    for (const auto& tensor : model.graph().initializer()) {
         if (tensor.data_location() != onnx::TensorProto_DataLocation_EXTERNAL) continue;
+        ExternalDataInfo info = get_external_data_info(tensor);
+        auto it = files.find(info.location);
+        if (it == files.end() || info.offset + info.length > it->second.size()
+            || tensor.data_type() == onnx::TensorProto_DataType_STRING) {
+            std::cerr << "Cannot map external tensor " << tensor.name() << " from " << info.location << "\n";
+            release_values();
+            return false;
+        }
+        // TensorProto_DataType and ONNXTensorElementDataType share their values
+        std::vector<int64_t> dims(tensor.dims().begin(), tensor.dims().end());
+        OrtValue* value = nullptr;
+        if (!checkStatus(g_ort_api->CreateTensorWithDataAsOrtValue(
+                             memory_info, it->second.data() + info.offset, info.length, dims.data(), dims.size(),
+                             static_cast<ONNXTensorElementDataType>(tensor.data_type()), &value),
+                         "CreateTensorWithDataAsOrtValue")) {
+            release_values();
+            return false;
+        }
+        names.push_back(tensor.name().c_str());
+        values.push_back(value);
+    }
+
+    // The options keep their own references to the values
+    bool ok = checkStatus(g_ort_api->AddExternalInitializers(session_options, names.data(), values.data(),
+                                                             values.size()),
+                          "AddExternalInitializers");
+    release_values();
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Topology-ordered weight prefetch
+//
+// With --load=mmap the sessions run on the mapped weights, which only become
+// resident when ORT first touches them: while prepacking during session
+// creation, or in the first run for the rest. The prefetcher asks the kernel
+// to read each initializer's pages ahead of time, in the order the graph
+// consumes them, from a thread of its own. ORT starts on the first weights
+// while later ones are still being read, and the first run finds them
+// resident.
+//------------------------------------------------------------------------------
+class WeightPrefetcher {
+public:
+    ~WeightPrefetcher() {
+        if (thread_.joinable()) thread_.join();
+    }
+
+    // With a tensor index the ranges are looked up there, without scanning
+    // the initializers' external_data.
+    void start(const onnx::ModelProto& model, const std::map<std::string, MappedFile>& files,
+               const TensorIndex& index) {
+        std::unordered_map<std::string, const onnx::TensorProto*> by_name;
+        if (index.size() == 0) {
+            for (const auto& tensor : model.graph().initializer()) by_name[tensor.name()] = &tensor;
+        }
+
+        const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        for (const auto& name : initializers_in_consumer_order(model.graph())) {
+            ExternalDataInfo info;
+            if (index.size() > 0) {
+                const TensorIndexEntry* entry = index.find(name);
+                if (!entry) continue;
+                info.location = std::string(index.location(*entry));
+                info.offset = entry->offset;
+                info.length = entry->length;
+            } else {
+                const onnx::TensorProto* tensor = by_name[name];
+                if (tensor->data_location() != onnx::TensorProto_DataLocation_EXTERNAL) continue;
+                info = get_external_data_info(*tensor);
+            }
+            auto it = files.find(info.location);
+            if (it == files.end() || info.length == 0 || info.offset + info.length > it->second.size()) continue;
+
+            // madvise() wants a page-aligned start
+            uintptr_t begin = reinterpret_cast<uintptr_t>(it->second.data() + info.offset);
+            uintptr_t aligned = begin & ~(page - 1);
+            ranges_.push_back({reinterpret_cast<char*>(aligned), info.length + (begin - aligned)});
+            bytes_ += info.length;
+        }
+
+        thread_ = std::thread([this]() {
+            auto begin = std::chrono::high_resolution_clock::now();
+            for (const auto& range : ranges_) madvise(range.addr, range.length, MADV_WILLNEED);
+            elapsed_ms_ = std::chrono::duration<double, std::milli>(
+                std::chrono::high_resolution_clock::now() - begin).count();
+        });
+    }
+
+    // Must be called before the mappings passed to start() are closed.
+    void join() {
+        if (!thread_.joinable()) return;
+        thread_.join();
+        printf("prefetch: advised %zu tensors (%.1f MiB) in consumer order in %0.02lfms\n",
+               ranges_.size(), bytes_ / (1024.0 * 1024.0), elapsed_ms_);
+    }
+
+private:
+    struct Range {
+        char* addr;
+        size_t length;
+    };
+    std::vector<Range> ranges_;
+    uint64_t bytes_ = 0;
+    std::thread thread_;
+    double elapsed_ms_ = 0;
+};
+
+//------------------------------------------------------------------------------
+// Background weight verification
+//
+// With --verify=background the checksums are recomputed once the session is
+// ready, on a couple of threads, so corrupt weights are still reported
+// without adding the pass to startup latency.
+//------------------------------------------------------------------------------
+class BackgroundVerifier {
+public:
+    ~BackgroundVerifier() {
+        if (thread_.joinable()) thread_.join();
+    }
+
+    void start(const std::string& base_dir, std::vector<ChecksumTarget> targets, unsigned threads) {
+        targets_ = std::move(targets);
+        thread_ = std::thread([this, base_dir, threads]() {
+            ok_ = verify_checksums(base_dir, targets_, threads, &stats_);
+        });
+    }
+
+    // Returns false if the verification ran and failed.
+    bool join() {
+        if (!thread_.joinable()) return true;
+        thread_.join();
+        printVerifyStats("background", stats_, ok_);
+        return ok_;
+    }
+
+    static void printVerifyStats(const char* mode, const VerifyStats& stats, bool ok) {
+        printf("verify (%s): %zu tensors (%.1f MiB) on %u threads with crc32c/%s in %0.02lfms: %s\n",
+               mode, stats.tensors, stats.bytes / (1024.0 * 1024.0), stats.threads,
+               stats.implementation, stats.elapsed_ms,
+               ok ? "ok" : "FAILED");
+    }
+
+private:
+    std::vector<ChecksumTarget> targets_;
+    VerifyStats stats_;
+    bool ok_ = true;
+    std::thread thread_;
+};
+
+//------------------------------------------------------------------------------
+// Session engine
+//
+// Owns what every session created from the same model can share. Today that
+// is the prepacked weights container: kernels such as MatMul repack their
+// constant weights at session creation, and with a shared container the
+// packed copy is made once per process instead of once per session.
+//------------------------------------------------------------------------------
+class Engine {
+public:
+    bool init(bool share_prepacked) {
+        if (!share_prepacked) return true;
+        OrtStatus* status = g_ort_api->CreatePrepackedWeightsContainer(&prepacked_);
+        if (status != nullptr) {
+            std::cerr << "CreatePrepackedWeightsContainer error: "
+                      << g_ort_api->GetErrorMessage(status) << std::endl;
+            g_ort_api->ReleaseStatus(status);
+            return false;
+        }
+        return true;
+    }
+
+    // Must only be called once every session created through the engine has
+    // been released.
+    void release() {
+        g_ort_api->ReleasePrepackedWeightsContainer(prepacked_);
+        prepacked_ = nullptr;
+    }
+
+    bool sharesPrepackedWeights() const { return prepacked_ != nullptr; }
+
+    // With `shared` false the session gets prepacked weights of its own,
+    // even if the engine has a container.
+    OrtSession* createSession(const void* bytes, size_t size, const OrtSessionOptions* session_options,
+                              bool shared = true) {
+        OrtSession* session = nullptr;
+        OrtStatus* status = prepacked_ && shared
+            ? g_ort_api->CreateSessionFromArrayWithPrepackedWeightsContainer(
+                  g_env, bytes, size, session_options, prepacked_, &session)
+            : g_ort_api->CreateSessionFromArray(g_env, bytes, size, session_options, &session);
+        if (status != nullptr) {
+            std::cerr << "Session creation failed: " << g_ort_api->GetErrorMessage(status) << "\n";
+            g_ort_api->ReleaseStatus(status);
+            return nullptr;
+        }
+        return session;
+    }
+
+private:
+    OrtPrepackedWeightsContainer* prepacked_ = nullptr;
+};
+
+// Create one session per entry of `intra_op_threads` (0: ORT's default) from
+// the same model bytes and options, and report what each one added to RSS.
+// If `session_options` asks ORT to save the optimized model, only the first
+// session writes it.
+//
+// The RSS an extra session adds also holds costs every session pays, such as
+// thread pools and arenas, so it does not tell what sharing the prepacked
+// weights saved. With `measure_prepacked`, the extra sessions are created a
+// second time without the container, and what they add is compared. Those
+// copies are released again, but they add to startup time and peak RSS.
+bool createSessions(Engine& engine, const void* bytes, size_t size,
+                    OrtSessionOptions* session_options,
+                    const std::vector<int>& intra_op_threads,
+                    bool measure_prepacked,
+                    std::vector<OrtSession*>& sessions) {
+    std::vector<size_t> rss_growth;
+    for (int threads : intra_op_threads) {
+        OrtStatus* status = g_ort_api->SetIntraOpNumThreads(session_options, threads);
+        if (status != nullptr) {
+            std::cerr << "SetIntraOpNumThreads error: " << g_ort_api->GetErrorMessage(status) << "\n";
+            g_ort_api->ReleaseStatus(status);
+            break;
+        }
+
+        size_t rss_before = current_rss_bytes();
+        OrtSession* session = engine.createSession(bytes, size, session_options);
+        if (!session) break;
+        size_t rss_after = current_rss_bytes();
+        rss_growth.push_back(rss_after > rss_before ? rss_after - rss_before : 0);
+        sessions.push_back(session);
+
+        if (sessions.size() == 1) {
+            status = g_ort_api->SetOptimizedModelFilePath(session_options, "");
+            if (status != nullptr) g_ort_api->ReleaseStatus(status);
+        }
+    }
+
+    if (sessions.size() != intra_op_threads.size()) {
+        for (auto* session : sessions) g_ort_api->ReleaseSession(session);
+        sessions.clear();
+        return false;
+    }
+
+    if (sessions.size() > 1) {
+        const double mib = 1024.0 * 1024.0;
+        size_t first = rss_growth[0];
+        size_t others = std::accumulate(rss_growth.begin() + 1, rss_growth.end(), size_t{0});
+        size_t others_avg = others / (rss_growth.size() - 1);
+        printf("sessions: %zu created, first +%.1f MiB RSS, others +%.1f MiB on average\n",
+               sessions.size(), first / mib, others_avg / mib);
+
+        if (measure_prepacked && engine.sharesPrepackedWeights()) {
+            AutoTime t("measuring prepacked sharing");
+            std::vector<OrtSession*> unshared;
+            size_t unshared_growth = 0;
+            for (size_t i = 1; i < intra_op_threads.size(); ++i) {
+                OrtStatus* status = g_ort_api->SetIntraOpNumThreads(session_options, intra_op_threads[i]);
+                if (status != nullptr) {
+                    g_ort_api->ReleaseStatus(status);
+                    break;
+                }
+                size_t rss_before = current_rss_bytes();
+                OrtSession* session = engine.createSession(bytes, size, session_options, false);
+                if (!session) break;
+                size_t rss_after = current_rss_bytes();
+                unshared_growth += rss_after > rss_before ? rss_after - rss_before : 0;
+                unshared.push_back(session);
+            }
+            for (auto* session : unshared) g_ort_api->ReleaseSession(session);
+            if (unshared.size() == sessions.size() - 1) {
+                double saved = (double(unshared_growth) - double(others)) / mib;
+                printf("prepacked weights: %zu extra sessions add %.1f MiB RSS sharing them, %.1f MiB without,"
+                       " %.1f MiB saved\n",
+                       unshared.size(), others / mib, unshared_growth / mib, saved);
+            } else {
+                std::cerr << "prepacked weights: failed to create the unshared sessions to compare with\n";
+            }
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Optimized-model cache
+//------------------------------------------------------------------------------
+bool addSessionConfigEntry(OrtSessionOptions* session_options, const char* key, const char* value) {
+    OrtStatus* status = g_ort_api->AddSessionConfigEntry(session_options, key, value);
+    if (status != nullptr) {
+        std::cerr << "AddSessionConfigEntry(" << key << ") error: "
+                  << g_ort_api->GetErrorMessage(status) << std::endl;
+        g_ort_api->ReleaseStatus(status);
+        return false;
+    }
+    return true;
+}
+
+// Ask ORT to write the optimized graph to `path` in ORT format while it
+// creates the session.
+bool saveOptimizedModelTo(OrtSessionOptions* session_options, const std::string& path) {
+    OrtStatus* status = g_ort_api->SetOptimizedModelFilePath(session_options, path.c_str());
+    if (status != nullptr) {
+        std::cerr << "SetOptimizedModelFilePath error: "
+                  << g_ort_api->GetErrorMessage(status) << std::endl;
+        g_ort_api->ReleaseStatus(status);
+        return false;
+    }
+    return addSessionConfigEntry(session_options, "session.save_model_format", "ORT");
+}
+
+// Build the options for loading a cached ORT-format model. The graph in it is
+// already fully optimized, so optimizations are turned off and ORT reads the
+// model (and with `use_mmap`, the initializers too) straight out of our
+// buffer, which must therefore outlive the session.
+OrtSessionOptions* createCachedSessionOptions(bool use_mmap) {
+    OrtSessionOptions* session_options = createSessionOptions();
+    if (!session_options) return nullptr;
+
+    OrtStatus* status = g_ort_api->SetSessionGraphOptimizationLevel(session_options, ORT_DISABLE_ALL);
+    if (status != nullptr) {
+        std::cerr << "SetSessionGraphOptimizationLevel error: "
+                  << g_ort_api->GetErrorMessage(status) << std::endl;
+        g_ort_api->ReleaseStatus(status);
+        g_ort_api->ReleaseSessionOptions(session_options);
+        return nullptr;
+    }
+    if (!addSessionConfigEntry(session_options, "session.load_model_format", "ORT")
+        || !addSessionConfigEntry(session_options, "session.use_ort_model_bytes_directly", "1")
+        || (use_mmap && !addSessionConfigEntry(session_options, "session.use_ort_model_bytes_for_initializers", "1"))) {
+        g_ort_api->ReleaseSessionOptions(session_options);
+        return nullptr;
+    }
+    return session_options;
+}
+
+//------------------------------------------------------------------------------
+// Pre-fork workers
+//
+// The parent loads the model once and forks; every worker inherits the
+// session, and with it the weights, copy-on-write. ORT creates a session's
+// thread pools together with the session and threads do not survive fork(),
+// so prefork sessions are single-threaded and the parent refuses to fork
+// unless it is down to its main thread. Parallelism comes from the workers.
+//------------------------------------------------------------------------------
+struct WorkerReport {
+    unsigned index;
+    double ready_ms;  // from fork() to running in the worker
+    double avg_ms;    // mean inference time
+    size_t rss;
+    size_t pss;
+};
+
+bool runPreforkWorkers(OrtSession* session,
+                       const std::vector<std::string>& input_names,
+                       const std::vector<std::string>& output_names,
+                       const std::vector<int64_t>& input_ids,
+                       const std::vector<int64_t>& attention_mask,
+                       RunMode run_mode, unsigned workers, size_t runs) {
+    const double mib = 1024.0 * 1024.0;
+
+    // 1) Warm up, so state ORT initializes lazily on the first runs is shared too
+    for (int i = 0; i < 3; ++i) runInference(session, input_names, output_names, input_ids, attention_mask);
+
+    size_t threads = thread_count();
+    if (threads > 1) {
+        std::cerr << "prefork: refusing to fork with " << threads << " threads running; "
+                  << "their state would be lost in the workers\n";
+        return false;
+    }
+    printf("prefork: parent has %zu thread(s), RSS %.1f MiB, PSS %.1f MiB before fork\n",
+           threads, current_rss_bytes() / mib, proportional_set_size_bytes() / mib);
+    fflush(stdout);
+
+    // 2) Fork. Workers report through one pipe and block on the other until
+    // every worker has reported, so all PSS figures are taken while the pages
+    // are shared by everyone.
+    int report_pipe[2], release_pipe[2];
+    if (pipe(report_pipe) != 0 || pipe(release_pipe) != 0) {
+        perror("prefork: pipe");
+        return false;
+    }
+
+    std::vector<pid_t> pids;
+    auto fork_time = std::chrono::high_resolution_clock::now();
+    for (unsigned i = 0; i < workers; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("prefork: fork");
+            break;
+        }
+        if (pid == 0) {
+            WorkerReport report{};
+            report.index = i;
+            report.ready_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::high_resolution_clock::now() - fork_time).count();
+            close(report_pipe[0]);
+            close(release_pipe[1]);
+
+            // Each worker builds its own context. A worker that cannot still
+            // reports, so that the parent is not left waiting.
+            Runner runner;
+            bool ready = runner.init(run_mode, session, input_names, output_names);
+            double total_ms = 0.0;
+            for (size_t r = 0; ready && r < runs; ++r) {
+                auto start_time = std::chrono::high_resolution_clock::now();
+                runner.run(input_ids, attention_mask);
+                total_ms += std::chrono::duration<double, std::milli>(
+                    std::chrono::high_resolution_clock::now() - start_time).count();
+            }
+            report.avg_ms = total_ms / static_cast<double>(runs);
+            report.rss = current_rss_bytes();
+            report.pss = proportional_set_size_bytes();
+
+            bool sent = write(report_pipe[1], &report, sizeof(report)) == static_cast<ssize_t>(sizeof(report));
+            char c;
+            while (read(release_pipe[0], &c, 1) < 0 && errno == EINTR) {}
+            _exit(sent && ready ? 0 : 1);
+        }
+        pids.push_back(pid);
+    }
+    close(report_pipe[1]);
+    close(release_pipe[0]);
+
+    // 3) Collect the reports, then let the workers go
+    std::vector<WorkerReport> reports;
+    WorkerReport report;
+    while (reports.size() < pids.size() && read(report_pipe[0], &report, sizeof(report)) == sizeof(report)) {
+        reports.push_back(report);
+    }
+    size_t parent_pss = proportional_set_size_bytes();
+    close(release_pipe[1]);
+    close(report_pipe[0]);
+
+    bool ok = pids.size() == workers && reports.size() == workers;
+    for (pid_t pid : pids) {
+        int status = 0;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+    }
+
+    size_t total_pss = parent_pss;
+    std::sort(reports.begin(), reports.end(),
+              [](const WorkerReport& a, const WorkerReport& b) { return a.index < b.index; });
+    for (const auto& r : reports) {
+        printf("prefork: worker %u ready %0.02lfms after fork, %zu runs at %0.03lfms avg, RSS %.1f MiB, PSS %.1f MiB\n",
+               r.index + 1, r.ready_ms, runs, r.avg_ms, r.rss / mib, r.pss / mib);
+        total_pss += r.pss;
+    }
+    printf("prefork: parent + %zu workers use %.1f MiB PSS in total\n", reports.size(), total_pss / mib);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Concurrent clients
+//
+// --clients=N starts N threads, each sending requests of varied lengths one
+// after the other. Without batching every client runs the session itself,
+// through a context of its own. With --max-batch the requests go through a
+// BatchScheduler, which runs them as padded batches on a binding context.
+//------------------------------------------------------------------------------
+
+// A tokenized request of `length` tokens: [CLS], words from the sample
+// sentence, [SEP].
+void makeRequest(size_t length, std::vector<int64_t>& input_ids, std::vector<int64_t>& attention_mask) {
+    static const int64_t words[] = {1045, 2228, 2023, 2003, 6919};
+    input_ids.assign(length, 0);
+    for (size_t i = 0; i < length; ++i) input_ids[i] = words[i % 5];
+    input_ids.front() = 101;
+    input_ids.back() = 102;
+    attention_mask.assign(length, 1);
+}
+
+bool runClients(OrtSession* session,
+                const std::vector<std::string>& input_names,
+                const std::vector<std::string>& output_names,
+                RunMode run_mode, unsigned clients, size_t runs,
+                bool batching, const BatchOptions& batch_options) {
+    // The scheduler is declared last, so its dispatcher stops first
+    BindingContext binding;
+    BindingContext::Shape* shape = nullptr;
+    std::unique_ptr<BatchScheduler> scheduler;
+    if (batching) {
+        if (!binding.init(session, input_names, output_names)) return false;
+        BatchBackend backend;
+        backend.labels = binding.labels();
+        backend.prepare = [&](int64_t batch, int64_t length, BatchBuffers& buffers) {
+            shape = binding.shape(batch, length);
+            if (!shape) return false;
+            buffers.input_ids = shape->input_ids.data();
+            buffers.attention_mask = shape->attention_mask.data();
+            buffers.logits = shape->logits.data();
+            return true;
+        };
+        backend.run = [&]() { return binding.run(*shape); };
+        scheduler.reset(new BatchScheduler(std::move(backend), batch_options));
+    }
+
+    std::vector<std::vector<double>> latencies(clients);
+    std::atomic<size_t> failures{0};
+    auto client = [&](unsigned c) {
+        Runner runner;
+        if (!batching && !runner.init(run_mode, session, input_names, output_names)) {
+            failures += runs;
+            return;
+        }
+        std::vector<int64_t> input_ids, attention_mask;
+        for (size_t r = 0; r < runs; ++r) {
+            makeRequest(8 + (c * 7 + r * 13) % 57, input_ids, attention_mask);
+            auto start_time = std::chrono::high_resolution_clock::now();
+            bool ok;
+            if (batching) {
+                ok = !scheduler->submit(input_ids, attention_mask).get().empty();
+            } else {
+                ok = runner.run(input_ids, attention_mask) != nullptr;
+            }
+            latencies[c].push_back(std::chrono::duration<double, std::milli>(
+                std::chrono::high_resolution_clock::now() - start_time).count());
+            if (!ok) failures++;
+        }
+    };
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned c = 0; c < clients; ++c) threads.emplace_back(client, c);
+    for (auto& thread : threads) thread.join();
+    double elapsed_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - begin).count();
+
+    std::vector<double> all;
+    for (const auto& times : latencies) all.insert(all.end(), times.begin(), times.end());
+    std::sort(all.begin(), all.end());
+    if (all.empty()) return false;
+    if (batching) {
+        printf("clients: %u x %zu requests batched (max %zu, %0.02lfms, %zu tokens): %.1f requests/s,"
+               " p50 %0.03lfms, p99 %0.03lfms\n",
+               clients, runs, batch_options.max_batch, batch_options.max_delay.count() / 1000.0,
+               batch_options.token_budget, all.size() / (elapsed_ms / 1000.0),
+               all[all.size() / 2], all[all.size() * 99 / 100]);
+        BatchStats stats = scheduler->stats();
+        printf("batching: %zu requests in %zu batches, %.2f per batch, %zu full, %.1f%% padding,"
+               " %zu shapes bound\n",
+               stats.requests, stats.batches, stats.batches ? stats.requests / double(stats.batches) : 0.0,
+               stats.full,
+               stats.padded_tokens ? 100.0 * (stats.padded_tokens - stats.tokens) / stats.padded_tokens : 0.0,
+               binding.shapes());
+    } else {
+        printf("clients: %u x %zu requests with --run=%s: %.1f requests/s, p50 %0.03lfms, p99 %0.03lfms\n",
+               clients, runs, runModeName(run_mode), all.size() / (elapsed_ms / 1000.0),
+               all[all.size() / 2], all[all.size() * 99 / 100]);
+    }
+    if (failures > 0) std::cerr << "clients: " << failures << " requests failed\n";
+    return failures == 0;
+}
+
+//------------------------------------------------------------------------------
+// Sequence-length buckets
+//
+// ORT plans memory for each input shape it sees, and with dynamic lengths
+// nearly every request is a new shape. With --buckets, a request is padded up
+// to the smallest bucket that holds it. It then runs on a session created for
+// exactly [1, bucket] through AddFreeDimensionOverrideByName, so each session
+// only ever sees one shape. Requests longer than the largest bucket run
+// unpadded on the main session.
+//------------------------------------------------------------------------------
+
+// The symbolic names of the first input's [batch, sequence] dimensions.
+bool getInputDimensionNames(OrtSession* session, std::string& batch, std::string& sequence) {
+    OrtTypeInfo* type_info = nullptr;
+    const OrtTensorTypeAndShapeInfo* tensor_info = nullptr;
+    size_t rank = 0;
+    const char* names[2] = {"", ""};
+    bool ok = checkStatus(g_ort_api->SessionGetInputTypeInfo(session, 0, &type_info), "SessionGetInputTypeInfo")
+        && checkStatus(g_ort_api->CastTypeInfoToTensorInfo(type_info, &tensor_info), "CastTypeInfoToTensorInfo")
+        && checkStatus(g_ort_api->GetDimensionsCount(tensor_info, &rank), "GetDimensionsCount")
+        && rank == 2 && checkStatus(g_ort_api->GetSymbolicDimensions(tensor_info, names, 2), "GetSymbolicDimensions");
+    if (ok) {
+        batch = names[0];
+        sequence = names[1];
+    }
+    if (type_info) g_ort_api->ReleaseTypeInfo(type_info);
+    if (!ok || sequence.empty()) {
+        std::cerr << "buckets: the first input is not a [batch, sequence] tensor with a named sequence dimension.\n";
+        return false;
+    }
+    return true;
+}
+
+// Create one session per bucket from the same model bytes and options as
+// `session`. The overrides take effect through the graph transformers, which
+// a model from the optimized-model cache has already been through, so main()
+// never uses the cache with --buckets.
+bool createBucketSessions(Engine& engine, OrtSession* session, const void* bytes, size_t size,
+                          const OrtSessionOptions* session_options, const std::vector<int64_t>& buckets,
+                          std::vector<OrtSession*>& bucket_sessions) {
+    std::string batch_dim, sequence_dim;
+    if (!getInputDimensionNames(session, batch_dim, sequence_dim)) return false;
+
+    size_t rss_before = current_rss_bytes();
+    for (int64_t bucket : buckets) {
+        OrtSessionOptions* options = nullptr;
+        bool ok = checkStatus(g_ort_api->CloneSessionOptions(session_options, &options), "CloneSessionOptions")
+            && (batch_dim.empty()
+                || checkStatus(g_ort_api->AddFreeDimensionOverrideByName(options, batch_dim.c_str(), 1),
+                               "AddFreeDimensionOverrideByName"))
+            && checkStatus(g_ort_api->AddFreeDimensionOverrideByName(options, sequence_dim.c_str(), bucket),
+                           "AddFreeDimensionOverrideByName");
+        OrtSession* bucket_session = ok ? engine.createSession(bytes, size, options) : nullptr;
+        if (options) g_ort_api->ReleaseSessionOptions(options);
+        if (!bucket_session) {
+            for (auto* created : bucket_sessions) g_ort_api->ReleaseSession(created);
+            bucket_sessions.clear();
+            return false;
+        }
+        bucket_sessions.push_back(bucket_session);
+    }
+    size_t rss_after = current_rss_bytes();
+    printf("buckets: %zu sessions for %s = 1, %s = %lld..%lld, +%.1f MiB RSS\n",
+           bucket_sessions.size(), batch_dim.empty() ? "batch" : batch_dim.c_str(), sequence_dim.c_str(),
+           static_cast<long long>(buckets.front()), static_cast<long long>(buckets.back()),
+           (rss_after > rss_before ? rss_after - rss_before : 0) / (1024.0 * 1024.0));
+    return true;
+}
+
+// Pads each request to its bucket and runs it on that bucket's session.
+class BucketRunner {
+public:
+    bool init(const std::vector<int64_t>& buckets, const std::vector<OrtSession*>& bucket_sessions,
+              OrtSession* session,
+              const std::vector<std::string>& input_names,
+              const std::vector<std::string>& output_names) {
+        buckets_ = buckets;
+        contexts_.clear();
+        for (auto* bucket_session : bucket_sessions) {
+            contexts_.emplace_back(new BindingContext);
+            if (!contexts_.back()->init(bucket_session, input_names, output_names)) return false;
+        }
+        return contexts_.size() == buckets_.size() && unbucketed_.init(session, input_names, output_names);
+    }
+
+    // The logits, valid until the next run, or nullptr. `padded_length` is
+    // the length that actually ran.
+    const float* run(const std::vector<int64_t>& input_ids, const std::vector<int64_t>& attention_mask,
+                     size_t* padded_length) {
+        const size_t length = input_ids.size();
+        auto it = std::lower_bound(buckets_.begin(), buckets_.end(), static_cast<int64_t>(length));
+        *padded_length = length;
+        if (it == buckets_.end()) return unbucketed_.run(input_ids.data(), attention_mask.data(), length);
+
+        BindingContext& context = *contexts_[it - buckets_.begin()];
+        BindingContext::Shape* shape = context.shape(1, *it);
+        if (!shape) return nullptr;
+        std::copy(input_ids.begin(), input_ids.end(), shape->input_ids.begin());
+        std::copy(attention_mask.begin(), attention_mask.end(), shape->attention_mask.begin());
+        std::fill(shape->input_ids.begin() + length, shape->input_ids.end(), 0);
+        std::fill(shape->attention_mask.begin() + length, shape->attention_mask.end(), 0);
+        *padded_length = static_cast<size_t>(*it);
+        return context.run(*shape) ? shape->logits.data() : nullptr;
+    }
+
+private:
+    std::vector<int64_t> buckets_;
+    std::vector<std::unique_ptr<BindingContext>> contexts_;
+    InferenceContext unbucketed_;
+};
+
+// Run the same requests of varied lengths on the main session, then padded
+// to their buckets, and compare the tokens run against the latency.
+bool runBuckets(OrtSession* session, const std::vector<OrtSession*>& bucket_sessions,
+                const std::vector<int64_t>& buckets,
+                const std::vector<std::string>& input_names,
+                const std::vector<std::string>& output_names,
+                RunMode run_mode, size_t runs) {
+    Runner runner;
+    BucketRunner bucketed;
+    if (!runner.init(run_mode, session, input_names, output_names)
+        || !bucketed.init(buckets, bucket_sessions, session, input_names, output_names)) {
+        return false;
+    }
+
+    std::vector<size_t> lengths(runs);
+    for (size_t r = 0; r < runs; ++r) lengths[r] = 2 + (r * 97) % static_cast<size_t>(buckets.back() - 1);
+
+    struct Pass {
+        std::vector<double> times;
+        uint64_t tokens = 0;
+        std::map<size_t, size_t> shapes;  // length run -> requests
+    };
+    Pass passes[2];
+    std::vector<int64_t> input_ids, attention_mask;
+    for (int p = 0; p < 2; ++p) {
+        for (size_t length : lengths) {
+            makeRequest(length, input_ids, attention_mask);
+            size_t padded = length;
+            auto start_time = std::chrono::high_resolution_clock::now();
+            const float* logits = p == 0 ? runner.run(input_ids, attention_mask)
+                                         : bucketed.run(input_ids, attention_mask, &padded);
+            passes[p].times.push_back(std::chrono::duration<double, std::milli>(
+                std::chrono::high_resolution_clock::now() - start_time).count());
+            if (!logits) {
+                std::cerr << "buckets: request of " << length << " tokens failed.\n";
+                return false;
+            }
+            passes[p].tokens += padded;
+            passes[p].shapes[padded]++;
+        }
+    }
+
+    double means[2];
+    for (int p = 0; p < 2; ++p) {
+        std::vector<double>& times = passes[p].times;
+        means[p] = std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+        std::sort(times.begin(), times.end());
+        printf("%s: %zu requests in %zu shapes, %llu tokens, mean %0.03lfms, p50 %0.03lfms, p99 %0.03lfms\n",
+               p == 0 ? "unbucketed" : "bucketed", runs, passes[p].shapes.size(),
+               static_cast<unsigned long long>(passes[p].tokens), means[p],
+               times[times.size() / 2], times[times.size() * 99 / 100]);
+    }
+    printf("buckets: %.1f%% more tokens for padding, %+.1f%% mean latency\n",
+           100.0 * (passes[1].tokens - passes[0].tokens) / passes[0].tokens,
+           100.0 * (means[1] - means[0]) / means[0]);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Pipelined requests
+//
+// Each request is tokenized, run, then post-processed. This program has no
+// tokenizer, so --host-ms of busy work stands in for the host-side steps,
+// half before the run and half after. The synchronous loop does the three
+// steps one after the other. The pipelined loop keeps up to --async runs in
+// flight on an AsyncContext and prepares the next request meanwhile.
+//------------------------------------------------------------------------------
+
+// Busy-wait for `ms` milliseconds, as tokenization or post-processing would.
+void hostWork(double ms) {
+    auto until = std::chrono::steady_clock::now() + std::chrono::duration<double, std::milli>(ms);
+    while (std::chrono::steady_clock::now() < until) {
+    }
+}
 
-        std::string location;
-        size_t offset = 0, length = 0;
+// Softmax over the two logits: the probability of POSITIVE.
+float positiveProbability(const float* logits) {
+    return 1.0f / (1.0f + std::exp(logits[0] - logits[1]));
+}
+
+bool runPipelined(OrtSession* session,
+                  const std::vector<std::string>& input_names,
+                  const std::vector<std::string>& output_names,
+                  RunMode run_mode, size_t runs, unsigned depth, double host_ms) {
+    Runner runner;
+    AsyncContext async;
+    if (!runner.init(run_mode, session, input_names, output_names)
+        || !async.init(session, input_names, output_names)) {
+        return false;
+    }
+
+    auto tokenize = [&](size_t r, std::vector<int64_t>& input_ids, std::vector<int64_t>& attention_mask) {
+        makeRequest(8 + (r * 13) % 57, input_ids, attention_mask);
+        hostWork(host_ms / 2);
+    };
+    // Summed per loop, so the two can be checked against each other
+    double positive[2] = {0, 0};
+    int pass = 0;
+    auto postprocess = [&](const float* logits) {
+        positive[pass] += positiveProbability(logits);
+        hostWork(host_ms / 2);
+    };
 
-        for (const auto& entry : tensor.external_data()) {
-            if (entry.key() == "location") location = entry.value();
-            else if (entry.key() == "offset") offset = std::stoull(entry.value());
-            else if (entry.key() == "length") length = std::stoull(entry.value());
+    double elapsed_ms[2];
+    std::vector<int64_t> input_ids, attention_mask;
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (size_t r = 0; r < runs; ++r) {
+        tokenize(r, input_ids, attention_mask);
+        const float* logits = runner.run(input_ids, attention_mask);
+        if (!logits) {
+            std::cerr << "pipeline: synchronous request #" << (r + 1) << " failed.\n";
+            return false;
         }
+        postprocess(logits);
+    }
+    elapsed_ms[0] = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - begin).count();
+
+    std::deque<std::future<std::vector<float>>> in_flight;
+    size_t failures = 0;
+    auto finish_oldest = [&]() {
+        std::vector<float> logits = in_flight.front().get();
+        in_flight.pop_front();
+        if (logits.empty()) {
+            failures++;
+        } else {
+            postprocess(logits.data());
+        }
+    };
+    pass = 1;
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t r = 0; r < runs; ++r) {
+        tokenize(r, input_ids, attention_mask);
+        if (in_flight.size() == depth) finish_oldest();
+        in_flight.push_back(async.submit(input_ids, attention_mask));
+    }
+    while (!in_flight.empty()) finish_oldest();
+    elapsed_ms[1] = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - begin).count();
+    if (failures > 0) {
+        std::cerr << "pipeline: " << failures << " async requests failed.\n";
+        return false;
+    }
+    if (std::abs(positive[0] - positive[1]) > 1e-3 * runs) {
+        std::cerr << "pipeline: async results differ from the synchronous ones.\n";
+        return false;
+    }
+
+    printf("sync: %zu requests with --run=%s and %0.02lfms of host work each: %.1f requests/s\n",
+           runs, runModeName(run_mode), host_ms, runs / (elapsed_ms[0] / 1000.0));
+    printf("async: %zu requests, %u in flight: %.1f requests/s, %.2fx the synchronous loop\n",
+           runs, depth, runs / (elapsed_ms[1] / 1000.0), elapsed_ms[0] / elapsed_ms[1]);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Command line options
+//------------------------------------------------------------------------------
+enum class LoadMode {
+    Inline,   // copy weights into raw_data and serialize the full model
+    Mmap,     // mmap weights.data and register it with ORT in memory
+    LowPeak,  // read weights straight into the serialized model, free it early
+};
+
+enum class ParseMode {
+    Stream,  // ParseFromIstream into heap-allocated messages
+    Arena,   // mmap graph.onnx and parse into a protobuf Arena
+};
+
+enum class PrefetchMode {
+    None,      // pages are read when ORT first touches them
+    Topology,  // MADV_WILLNEED each initializer in consumer order
+};
+
+enum class VerifyMode {
+    Off,         // trust weights.data
+    Eager,       // check every tensor checksum before creating the session
+    Background,  // check them on a background thread once the session is ready
+};
+
+struct Options {
+    LoadMode load_mode = LoadMode::Inline;
+    PrefetchMode prefetch = PrefetchMode::None;
+    ParseMode parse_mode = ParseMode::Stream;
+    IoOptions io;
+    std::string cache_dir;  // empty: no optimized-model cache
+    std::vector<int> session_threads = {0};  // one session per entry
+    bool share_prepacked = true;
+    bool measure_prepacked = false;  // compare against sessions without the container
+    std::string trace_prefix;  // empty: no trace files
+    unsigned workers = 0;      // pre-forked worker processes, 0: run in-process
+    VerifyMode verify = VerifyMode::Off;
+    RunMode run_mode = RunMode::Context;
+    unsigned clients = 0;   // concurrent client threads, 0: single-threaded benchmark
+    bool batching = false;  // send the clients' requests through a BatchScheduler
+    BatchOptions batch;
+    std::vector<int64_t> buckets;  // sequence-length buckets, empty: none
+    unsigned async_depth = 0;  // RunAsync requests in flight, 0: no pipelined benchmark
+    double host_ms = 1.0;      // simulated tokenization and post-processing per request
+    bool cold = false;  // evict the weights from the page cache first
+};
+
+void printUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --load=inline|mmap|lowpeak how weights.data reaches ORT (default: inline)\n"
+              << "  --prefetch=none|topo with --load=mmap, prefetch weights in consumer order\n"
+              << "  --parse=stream|arena how graph.onnx is parsed (default: stream)\n"
+              << "  --io=pread|uring     backend for --load=inline reads (default: pread)\n"
+              << "  --io-threads=N       pread worker threads (default: one per core, max 8)\n"
+              << "  --cache-dir=DIR      reuse optimized ORT-format models cached in DIR\n"
+              << "  --sessions=T1,T2,... one session per entry, with T intra-op threads (0: default)\n"
+              << "  --share-prepacked=on|off|measure share prepacked weights between sessions (default: on);\n"
+              << "                       measure also creates the extra sessions unshared to report the saving\n"
+              << "  --trace=PREFIX       write the startup trace to PREFIX.json and PREFIX.trace.json\n"
+              << "  --workers=N          load once, then benchmark in N forked worker processes, each\n"
+              << "                       session on 1 intra-op thread; not with --clients, --async, --buckets\n"
+              << "  --verify=off|eager|background check weight checksums recorded by split (default: off)\n"
+              << "  --run=plain|context|binding per-call inputs, a context reused across runs, or\n"
+              << "                       IoBinding on buffers kept per shape (default: context)\n"
+              << "  --clients=N          benchmark N client threads sending requests of varied lengths\n"
+              << "  --max-batch=N        batch the clients' requests, up to N per run\n"
+              << "  --max-delay-ms=X     longest a request waits for its batch to fill (default: 2)\n"
+              << "  --token-budget=N     most padded tokens (batch x length) per run (default: 8192)\n"
+              << "  --buckets=L1,L2,...  pad requests to these lengths, each on a session specialized for it\n"
+              << "  --async=N            pipeline requests through RunAsync, N in flight, against a\n"
+              << "                       synchronous loop\n"
+              << "  --host-ms=X          simulated tokenization and post-processing per request (default: 1)\n"
+              << "  --cold               evict the weight files from the page cache before loading\n";
+}
+
+// A plain decimal count, with nothing before or after it
+bool parseCount(const std::string& value, size_t& out) {
+    if (value.empty() || value[0] < '0' || value[0] > '9') return false;
+    size_t pos = 0;
+    unsigned long long n = 0;
+    try {
+        n = std::stoull(value, &pos);
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (pos != value.size() || n > std::numeric_limits<size_t>::max()) return false;
+    out = static_cast<size_t>(n);
+    return true;
+}
+
+bool parseCount(const std::string& value, unsigned& out) {
+    size_t n = 0;
+    if (!parseCount(value, n) || n > std::numeric_limits<unsigned>::max()) return false;
+    out = static_cast<unsigned>(n);
+    return true;
+}
 
-        std::ifstream in(base_dir + "/" + location, std::ios::binary);
-        if (!in) {
-            std::cerr << "Failed to open external data file: " << location << "\n";
+// Non-negative milliseconds, at most a day
+bool parseMs(const std::string& value, double& out) {
+    if (value.empty() || value[0] == '-' || value[0] == '+' || std::isspace(static_cast<unsigned char>(value[0]))) {
+        return false;
+    }
+    size_t pos = 0;
+    double ms = 0;
+    try {
+        ms = std::stod(value, &pos);
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (pos != value.size() || !(ms >= 0 && ms <= 86400000.0)) return false;
+    out = ms;
+    return true;
+}
+
+bool parseArgs(int argc, char** argv, Options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string key = arg.substr(0, arg.find('='));
+        std::string value = arg.find('=') == std::string::npos ? "" : arg.substr(arg.find('=') + 1);
+        // Checked numeric values; a bad one falls through to the usage below
+        size_t n = 0;
+        unsigned count = 0;
+        double ms = 0;
+
+        if (key == "--load" && value == "inline") {
+            opts.load_mode = LoadMode::Inline;
+        } else if (key == "--load" && value == "mmap") {
+            opts.load_mode = LoadMode::Mmap;
+        } else if (key == "--load" && value == "lowpeak") {
+            opts.load_mode = LoadMode::LowPeak;
+        } else if (key == "--prefetch" && value == "none") {
+            opts.prefetch = PrefetchMode::None;
+        } else if (key == "--prefetch" && value == "topo") {
+            opts.prefetch = PrefetchMode::Topology;
+        } else if (key == "--parse" && value == "stream") {
+            opts.parse_mode = ParseMode::Stream;
+        } else if (key == "--parse" && value == "arena") {
+            opts.parse_mode = ParseMode::Arena;
+        } else if (key == "--io" && value == "pread") {
+            opts.io.backend = IoBackend::Pread;
+        } else if (key == "--io" && value == "uring") {
+            opts.io.backend = IoBackend::Uring;
+        } else if (key == "--io-threads" && parseCount(value, count)) {
+            opts.io.threads = count;
+        } else if (key == "--cache-dir" && !value.empty()) {
+            opts.cache_dir = value;
+        } else if (key == "--sessions" && !value.empty()) {
+            opts.session_threads.clear();
+            size_t pos = 0;
+            while (pos <= value.size()) {
+                size_t comma = value.find(',', pos);
+                if (comma == std::string::npos) comma = value.size();
+                if (!parseCount(value.substr(pos, comma - pos), n)
+                    || n > static_cast<size_t>(std::numeric_limits<int>::max())) {
+                    std::cerr << "Session thread counts must be non-negative integers: " << arg << "\n";
+                    return false;
+                }
+                opts.session_threads.push_back(static_cast<int>(n));
+                pos = comma + 1;
+            }
+        } else if (key == "--share-prepacked" && (value == "on" || value == "off" || value == "measure")) {
+            opts.share_prepacked = value != "off";
+            opts.measure_prepacked = value == "measure";
+        } else if (key == "--trace" && !value.empty()) {
+            opts.trace_prefix = value;
+        } else if (key == "--workers" && parseCount(value, count)) {
+            opts.workers = count;
+        } else if (key == "--verify" && value == "off") {
+            opts.verify = VerifyMode::Off;
+        } else if (key == "--verify" && value == "eager") {
+            opts.verify = VerifyMode::Eager;
+        } else if (key == "--verify" && value == "background") {
+            opts.verify = VerifyMode::Background;
+        } else if (key == "--run" && value == "plain") {
+            opts.run_mode = RunMode::Plain;
+        } else if (key == "--run" && value == "context") {
+            opts.run_mode = RunMode::Context;
+        } else if (key == "--run" && value == "binding") {
+            opts.run_mode = RunMode::Binding;
+        } else if (key == "--clients" && parseCount(value, count)) {
+            opts.clients = count;
+        } else if (key == "--max-batch" && parseCount(value, n) && n > 0) {
+            opts.batching = true;
+            opts.batch.max_batch = n;
+        } else if (key == "--max-delay-ms" && parseMs(value, ms)) {
+            opts.batch.max_delay = std::chrono::microseconds(static_cast<int64_t>(ms * 1000));
+        } else if (key == "--token-budget" && parseCount(value, n)) {
+            opts.batch.token_budget = n;
+        } else if (key == "--buckets" && !value.empty()) {
+            opts.buckets.clear();
+            size_t pos = 0;
+            while (pos <= value.size()) {
+                size_t comma = value.find(',', pos);
+                if (comma == std::string::npos) comma = value.size();
+                if (!parseCount(value.substr(pos, comma - pos), n)
+                    || n < 2 || n > static_cast<size_t>(std::numeric_limits<int64_t>::max())) {
+                    std::cerr << "Buckets must be token counts of at least 2: " << arg << "\n";
+                    return false;
+                }
+                opts.buckets.push_back(static_cast<int64_t>(n));
+                pos = comma + 1;
+            }
+            std::sort(opts.buckets.begin(), opts.buckets.end());
+            opts.buckets.erase(std::unique(opts.buckets.begin(), opts.buckets.end()), opts.buckets.end());
+        } else if (key == "--async" && parseCount(value, count)) {
+            opts.async_depth = count;
+        } else if (key == "--host-ms" && parseMs(value, ms)) {
+            opts.host_ms = ms;
+        } else if (key == "--cold" && value.empty()) {
+            opts.cold = true;
+        } else {
+            std::cerr << "Unknown argument: " << arg << "\n";
+            printUsage(argv[0]);
             return false;
         }
+    }
 
-        in.seekg(offset);
-        std::string raw_data(length, '\0');
-        in.read(&raw_data[0], length);
-        tensor.set_raw_data(raw_data);
-        tensor.set_data_location(onnx::TensorProto_DataLocation_DEFAULT);
-        tensor.clear_external_data();
+    // The workers run their own benchmark, on single-threaded sessions
+    if (opts.workers > 0 && (opts.clients > 0 || opts.async_depth > 0 || !opts.buckets.empty())) {
+        std::cerr << "--workers runs its own benchmark, drop --clients, --async and --buckets\n";
+        printUsage(argv[0]);
+        return false;
+    }
+    if (opts.workers > 0
+        && std::any_of(opts.session_threads.begin(), opts.session_threads.end(), [](int t) { return t > 1; })) {
+        std::cerr << "--workers needs single-threaded sessions, --sessions may only list 0 or 1\n";
+        printUsage(argv[0]);
+        return false;
     }
     return true;
 }
 
-int main() {
+int main(int argc, char** argv) {
+  Options opts;
+  if (!parseArgs(argc, argv, opts)) return 1;
+  if (opts.workers > 0) {
+      // Per-session thread pools would not survive fork()
+      for (auto& threads : opts.session_threads) threads = 1;
+      std::cout << "workers: sessions use 1 intra-op thread each\n";
+  }
+  trace_begin("startup");
+
   {
     AutoTime t("dlopen(libonnxruntime)");
     if (!initRuntime("libonnxruntime.so")) return 1;
   }
 
   std::vector<char> graph_buf;
+  MappedFile graph_file;
+  std::unique_ptr<google::protobuf::Arena> graph_arena;
+  onnx::ModelProto heap_model;
 
     // Step 1: Load graph.onnx
-    onnx::ModelProto model;
-    {
-      AutoTime t("stream loading graph");
-      std::ifstream in("graph.onnx", std::ios::binary);
-      if (!in || !model.ParseFromIstream(&in)) {
-          std::cerr << "Failed to load graph.onnx\n";
-          return 1;
+    onnx::ModelProto* model = &heap_model;
+    if (opts.parse_mode == ParseMode::Arena) {
+      size_t allocs_before = g_heap_allocs.load();
+      {
+        AutoTime t("arena loading graph");
+        if (!graph_file.open("graph.onnx")) {
+            std::cerr << "Failed to map graph.onnx\n";
+            return 1;
+        }
+        // Size the first block after the file so small graphs fit in one block.
+        google::protobuf::ArenaOptions arena_options;
+        arena_options.start_block_size = std::max<size_t>(graph_file.size(), arena_options.start_block_size);
+        arena_options.max_block_size = std::max<size_t>(graph_file.size(), arena_options.max_block_size);
+        graph_arena = std::make_unique<google::protobuf::Arena>(arena_options);
+        model = parse_model_on_arena(graph_file, graph_arena.get());
+        if (!model) {
+            std::cerr << "Failed to load graph.onnx\n";
+            return 1;
+        }
       }
+      printf("arena loading graph: %zu heap allocations, %llu bytes in arena (%llu used)\n",
+             g_heap_allocs.load() - allocs_before,
+             static_cast<unsigned long long>(graph_arena->SpaceAllocated()),
+             static_cast<unsigned long long>(graph_arena->SpaceUsed()));
+    } else {
+      size_t allocs_before = g_heap_allocs.load();
+      {
+        AutoTime t("stream loading graph");
+        if (opts.load_mode == LoadMode::Mmap) {
+            // Keep the serialized bytes around: they are handed to ORT as-is.
+            if (!loadFileToBuffer("graph.onnx", graph_buf) ||
+                !model->ParseFromArray(graph_buf.data(), static_cast<int>(graph_buf.size()))) {
+                std::cerr << "Failed to load graph.onnx\n";
+                return 1;
+            }
+        } else {
+            std::ifstream in("graph.onnx", std::ios::binary);
+            if (!in || !model->ParseFromIstream(&in)) {
+                std::cerr << "Failed to load graph.onnx\n";
+                return 1;
+            }
+        }
+      }
+      printf("stream loading graph: %zu heap allocations\n", g_heap_allocs.load() - allocs_before);
     }
 
-    {
-      AutoTime t("loading weights");
-      // Step 2: Load external weights from weights.data
-      if (!load_external_data_for_model(model, ".")) {
-          std::cerr << "Failed to load external weights\n";
-          return 1;
+    // split's tensor index, unless it was written for another graph.onnx
+    TensorIndex tensor_index;
+    if (tensor_index.open(kTensorIndexFile) && !tensor_index.describes("graph.onnx")) {
+        std::cerr << "Ignoring " << kTensorIndexFile << ", written for another graph.onnx\n";
+        tensor_index.close();
+    }
+
+    size_t peak_rss_before_load = peak_rss_bytes();
+
+    // Look for an optimized model left behind by a previous start. Bucket
+    // sessions need the graph transformers the cached model has already run,
+    // so --buckets always starts from graph.onnx.
+    std::string cache_path;
+    if (!opts.cache_dir.empty() && !opts.buckets.empty()) {
+      std::cout << "Not using the optimized-model cache with --buckets\n";
+    } else if (!opts.cache_dir.empty()) {
+      AutoTime t("hashing model for cache");
+      std::string key;
+      mkdir(opts.cache_dir.c_str(), 0755);
+      if (model_cache_key(".", "graph.onnx", external_data_locations(*model), has_external_data_checksums(*model),
+                          g_ort_version, key)) {
+          cache_path = opts.cache_dir + "/" + key + ".ort";
+      }
+    }
+
+    Engine engine;
+    if (!engine.init(opts.share_prepacked)) return 1;
+
+    std::vector<OrtSession*> sessions;
+    OrtSessionOptions* session_options = nullptr;
+    MappedFile cached_file;
+    std::vector<char> cached_buf;
+    // What the sessions were created from, kept for the bucket sessions
+    const char* session_bytes = nullptr;
+    size_t session_size = 0;
+    if (!cache_path.empty() && access(cache_path.c_str(), R_OK) == 0) {
+      AutoTime t("creating session from cache");
+      bool use_mmap = opts.load_mode == LoadMode::Mmap;
+      bool loaded = use_mmap ? cached_file.open(cache_path) : loadFileToBuffer(cache_path, cached_buf);
+      session_options = loaded ? createCachedSessionOptions(use_mmap) : nullptr;
+      if (session_options
+          && createSessions(engine,
+                            use_mmap ? cached_file.data() : cached_buf.data(),
+                            use_mmap ? cached_file.size() : cached_buf.size(),
+                            session_options, opts.session_threads, opts.measure_prepacked, sessions)) {
+          std::cout << "Loaded optimized model from " << cache_path << "\n";
+          session_bytes = use_mmap ? cached_file.data() : cached_buf.data();
+          session_size = use_mmap ? cached_file.size() : cached_buf.size();
+      } else {
+          // Stale or corrupt entry: drop it and rebuild it below.
+          std::remove(cache_path.c_str());
+          g_ort_api->ReleaseSessionOptions(session_options);
+          session_options = nullptr;
       }
     }
 
     std::string model_buf;
-    {
-      AutoTime t("serializing into mem");
-      // Step 3: Serialize full model to memory
-      model_buf = model.SerializeAsString();
+    std::map<std::string, MappedFile> weight_files;
+    WeightPrefetcher prefetcher;
+    std::vector<ChecksumTarget> checksums;
+
+    if (sessions.empty()) {
+      if (opts.cold) evict_external_data(*model, ".");
+
+      // A cached session does not read weights.data, so only this path
+      // needs checking.
+      if (opts.verify != VerifyMode::Off) {
+          size_t unchecked = 0;
+          checksums = tensor_index.size() > 0 ? collect_checksum_targets(tensor_index, &unchecked)
+                                              : collect_checksum_targets(*model, &unchecked);
+          if (unchecked > 0) {
+              std::cerr << "verify: " << unchecked << " external tensors have no checksum, re-run split\n";
+          }
+      }
+      if (opts.verify == VerifyMode::Eager) {
+          VerifyStats stats;
+          bool ok;
+          {
+            AutoTime t("verifying weights");
+            ok = verify_checksums(".", checksums, 0, &stats);
+          }
+          BackgroundVerifier::printVerifyStats("eager", stats, ok);
+          if (!ok) return 1;
+      }
+
+      session_options = createSessionOptions();
+      if (!session_options) return 1;
+
+      // Written under a temporary name and renamed once complete, so a
+      // concurrent start never picks up a half-written model.
+      std::string cache_tmp_path;
+      if (!cache_path.empty()) {
+          cache_tmp_path = cache_path + ".tmp." + std::to_string(getpid());
+          if (!saveOptimizedModelTo(session_options, cache_tmp_path)) cache_tmp_path.clear();
+      }
+
+      if (opts.load_mode == LoadMode::Mmap) {
+        AutoTime t("mapping weights");
+        // Step 2: Map weights.data, graph.onnx keeps pointing at it
+        if (!add_mapped_external_data(*model, ".", session_options, weight_files)) {
+            std::cerr << "Failed to map external weights\n";
+            return 1;
+        }
+        if (opts.prefetch == PrefetchMode::Topology) prefetcher.start(*model, weight_files, tensor_index);
+        if (graph_file.data()) {
+            session_bytes = graph_file.data();
+            session_size = graph_file.size();
+        } else {
+            session_bytes = graph_buf.data();
+            session_size = graph_buf.size();
+        }
+      } else if (opts.load_mode == LoadMode::LowPeak) {
+        {
+          AutoTime t("serializing with weights");
+          // Steps 2+3: Read weights.data straight into the serialized model
+          if (!serialize_with_external_data(*model, ".", opts.io, model_buf)) {
+              std::cerr << "Failed to load external weights\n";
+              return 1;
+          }
+        }
+
+        // The parsed graph is not needed anymore
+        model = nullptr;
+        graph_arena.reset();
+        graph_file.close();
+        onnx::ModelProto().Swap(&heap_model);
+        session_bytes = model_buf.data();
+        session_size = model_buf.size();
+      } else {
+        {
+          AutoTime t("loading weights");
+          // Step 2: Load external weights from weights.data
+          if (!load_external_data_for_model(*model, ".", opts.io)) {
+              std::cerr << "Failed to load external weights\n";
+              return 1;
+          }
+        }
+
+        {
+          AutoTime t("serializing into mem");
+          // Step 3: Serialize full model to memory
+          model_buf = model->SerializeAsString();
+        }
+        session_bytes = model_buf.data();
+        session_size = model_buf.size();
+      }
+
+      // Step 4: Create session(s)
+      {
+        AutoTime t("creating session");
+        if (!createSessions(engine, session_bytes, session_size, session_options,
+                            opts.session_threads, opts.measure_prepacked, sessions)) {
+            if (!cache_tmp_path.empty()) std::remove(cache_tmp_path.c_str());
+            return 1;
+        }
+      }
+
+      if (!cache_tmp_path.empty()) {
+          if (std::rename(cache_tmp_path.c_str(), cache_path.c_str()) == 0) {
+              std::cout << "Stored optimized model in " << cache_path << "\n";
+          } else {
+              std::remove(cache_tmp_path.c_str());
+          }
+      }
     }
 
-    OrtMemoryInfo* mem_info = nullptr;
-    (void)g_ort_api->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, &mem_info);
+    std::vector<OrtSession*> bucket_sessions;
+    if (!opts.buckets.empty()) {
+      AutoTime t("creating bucket sessions");
+      if (!createBucketSessions(engine, sessions[0], session_bytes, session_size, session_options,
+                                opts.buckets, bucket_sessions)) {
+          return 1;
+      }
+    }
 
-    // Step 4: Create session
-    OrtSessionOptions* session_options = createSessionOptions();
-    OrtSession* session = nullptr;
-    OrtStatus* status = g_ort_api->CreateSessionFromArray(
-        g_env, model_buf.data(), model_buf.size(), session_options, &session);
-    if (status) {
-        std::cerr << "Session creation failed: " << g_ort_api->GetErrorMessage(status) << "\n";
-        g_ort_api->ReleaseStatus(status);
-        return 1;
+    if (opts.load_mode == LoadMode::LowPeak && !model_buf.empty()) {
+        // Every session has its own initializers now
+        std::string().swap(model_buf);
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+    }
+
+    // The sessions run on the mapped weights, which stay mapped until the end
+    prefetcher.join();
+    if (graph_arena) {
+      AutoTime t("freeing graph arena");
+      model = nullptr;
+      graph_arena.reset();
+      graph_file.close();
     }
 
+    printf("memory: peak RSS %.1f MiB before loading weights, %.1f MiB after session creation, %.1f MiB now\n",
+           peak_rss_before_load / (1024.0 * 1024.0), peak_rss_bytes() / (1024.0 * 1024.0),
+           current_rss_bytes() / (1024.0 * 1024.0));
+
+    OrtSession* session = sessions[0];
+
     // 4) Discover the input/output names from the model
-    auto [input_names, output_names] = getModelInputOutputNames(session);
+    std::vector<std::string> input_names, output_names;
+    {
+      AutoTime t("discovering input/output names");
+      std::tie(input_names, output_names) = getModelInputOutputNames(session);
+    }
+
+    printf("startup: %0.02lfms to session ready\n", trace_end());
+
+    // Two threads leave the remaining cores to the inferences below
+    BackgroundVerifier verifier;
+    if (opts.verify == VerifyMode::Background && !checksums.empty()) {
+        verifier.start(".", std::move(checksums), 2);
+    }
+    if (!opts.trace_prefix.empty()) {
+        if (trace_write_json(opts.trace_prefix + ".json") &&
+            trace_write_chrome(opts.trace_prefix + ".trace.json")) {
+            std::cout << "Wrote startup trace to " << opts.trace_prefix << ".json and "
+                      << opts.trace_prefix << ".trace.json\n";
+        } else {
+            std::cerr << "Failed to write startup trace to " << opts.trace_prefix << "\n";
+        }
+    }
 
     std::cout << "Discovered " << input_names.size() << " input(s):\n";
     for (auto& nm : input_names) {
@@ -445,55 +2590,111 @@ int main() {
     std::vector<int64_t> input_ids      = {101, 1045, 2228, 2023, 2003, 6919, 102};
     std::vector<int64_t> attention_mask = {   1,    1,    1,    1,    1,    1,   1};
 
+    // Check that the extra sessions answer like the first one
+    for (size_t i = 1; i < sessions.size(); ++i) {
+        std::vector<float> logits = runInference(sessions[i], input_names, output_names, input_ids, attention_mask);
+        if (logits.empty()) {
+            std::cerr << "Session #" << (i + 1) << ": runInference returned empty logits.\n";
+        } else {
+            std::cout << "Session #" << (i + 1) << " (" << opts.session_threads[i] << " intra-op threads): NEG="
+                      << logits[0] << ", POS=" << logits[1] << "\n";
+        }
+    }
+
     // We'll run the inference 25 times and measure durations
     const size_t NUM_RUNS = 25;
-    std::vector<double> timings(NUM_RUNS, 0.0);
+    int exit_code = 0;
+
+    if (opts.workers > 0) {
+        // The workers run the benchmark, the parent only supervises them
+        if (!runPreforkWorkers(session, input_names, output_names, input_ids, attention_mask,
+                               opts.run_mode, opts.workers, NUM_RUNS)) {
+            exit_code = 1;
+        }
+    } else if (opts.clients > 0) {
+        if (!runClients(session, input_names, output_names, opts.run_mode, opts.clients, NUM_RUNS,
+                        opts.batching, opts.batch)) {
+            exit_code = 1;
+        }
+    } else if (opts.async_depth > 0) {
+        if (!runPipelined(session, input_names, output_names, opts.run_mode, 4 * NUM_RUNS,
+                          opts.async_depth, opts.host_ms)) {
+            exit_code = 1;
+        }
+    } else if (!opts.buckets.empty()) {
+        // Enough requests for every bucket to run several times
+        if (!runBuckets(session, bucket_sessions, opts.buckets, input_names, output_names,
+                        opts.run_mode, 4 * NUM_RUNS)) {
+            exit_code = 1;
+        }
+    } else {
+        std::vector<double> timings(NUM_RUNS, 0.0);
+        Runner runner;
+        if (!runner.init(opts.run_mode, session, input_names, output_names)) return 1;
 
-    // Loop 25 times
-    for (size_t i = 0; i < NUM_RUNS; ++i) {
-        auto start_time = std::chrono::high_resolution_clock::now();
+        // Heap allocations of every run but the first, which sets the context up
+        size_t steady_allocs = 0;
 
-        std::vector<float> logits = runInference(session, input_names, output_names, input_ids, attention_mask);
+        // Loop 25 times
+        for (size_t i = 0; i < NUM_RUNS; ++i) {
+            size_t allocs_before = g_heap_allocs.load();
+            auto start_time = std::chrono::high_resolution_clock::now();
 
-        auto end_time = std::chrono::high_resolution_clock::now();
-        double elapsed_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+            const float* logits = runner.run(input_ids, attention_mask);
 
-        timings[i] = elapsed_ms;
+            auto end_time = std::chrono::high_resolution_clock::now();
+            double elapsed_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+            if (i > 0) steady_allocs += g_heap_allocs.load() - allocs_before;
 
-        // For debugging, you might print an example result each time:
-        if (!logits.empty()) {
-            float neg_logit = logits[0];
-            float pos_logit = logits[1];
-            std::string sentiment = (pos_logit > neg_logit) ? "POSITIVE" : "NEGATIVE";
-            std::cout << "Run #" << (i + 1) << ": NEG=" << neg_logit
-                      << ", POS=" << pos_logit
-                      << ", sentiment=" << sentiment
-                      << ", time=" << elapsed_ms << " ms\n";
-        } else {
-            std::cerr << "Run #" << (i + 1) << ": runInference returned empty logits.\n";
+            timings[i] = elapsed_ms;
+
+            // For debugging, you might print an example result each time:
+            if (logits) {
+                float neg_logit = logits[0];
+                float pos_logit = logits[1];
+                std::string sentiment = (pos_logit > neg_logit) ? "POSITIVE" : "NEGATIVE";
+                std::cout << "Run #" << (i + 1) << ": NEG=" << neg_logit
+                          << ", POS=" << pos_logit
+                          << ", sentiment=" << sentiment
+                          << ", time=" << elapsed_ms << " ms\n";
+            } else {
+                std::cerr << "Run #" << (i + 1) << ": runInference returned empty logits.\n";
+            }
         }
-    }
 
-    // Compute some performance statistics
-    double sum_time = std::accumulate(timings.begin(), timings.end(), 0.0);
-    double avg_time = sum_time / static_cast<double>(NUM_RUNS);
+        // Compute some performance statistics
+        double sum_time = std::accumulate(timings.begin(), timings.end(), 0.0);
+        double avg_time = sum_time / static_cast<double>(NUM_RUNS);
+
+        // Find min and max
+        auto minmax = std::minmax_element(timings.begin(), timings.end());
+        double min_time = *minmax.first;
+        double max_time = *minmax.second;
+        std::vector<double> sorted = timings;
+        std::sort(sorted.begin(), sorted.end());
 
-    // Find min and max
-    auto minmax = std::minmax_element(timings.begin(), timings.end());
-    double min_time = *minmax.first;
-    double max_time = *minmax.second;
+        std::cout << "\nPerformance over " << NUM_RUNS << " runs:\n";
+        std::cout << "  Average time: " << avg_time << " ms\n";
+        std::cout << "  Median time:  " << sorted[NUM_RUNS / 2] << " ms\n";
+        std::cout << "  Min time:     " << min_time << " ms\n";
+        std::cout << "  Max time:     " << max_time << " ms\n";
+        // ORT's own allocations are counted too
+        std::cout << "  Heap allocations: " << steady_allocs / static_cast<double>(NUM_RUNS - 1)
+                  << " per run after the first, with --run="
+                  << runModeName(opts.run_mode) << "\n";
+    }
 
-    std::cout << "\nPerformance over " << NUM_RUNS << " runs:\n";
-    std::cout << "  Average time: " << avg_time << " ms\n";
-    std::cout << "  Min time:     " << min_time << " ms\n";
-    std::cout << "  Max time:     " << max_time << " ms\n";
+    if (!verifier.join()) exit_code = 1;
 
     // Cleanup
-    g_ort_api->ReleaseSession(session);
+    for (auto* s : sessions) g_ort_api->ReleaseSession(s);
+    for (auto* s : bucket_sessions) g_ort_api->ReleaseSession(s);
+    engine.release();
+    weight_files.clear();
     g_ort_api->ReleaseSessionOptions(session_options);
     g_ort_api->ReleaseEnv(g_env);
     dlclose(g_handle);
 
     std::cout << "Done.\n";
-    return 0;
+    return exit_code;
 }
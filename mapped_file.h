@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only, shared memory mapping of a whole file.
+//
+// The pages come straight from the page cache, so nothing is copied onto the
+// heap and every process mapping the same file shares the same physical pages.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+    : data_(other.data_), size_(other.size_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            close();
+            data_ = other.data_;
+            size_ = other.size_;
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    // With `alignment` above the page size the mapping itself starts on an
+    // `alignment` boundary, so file offsets aligned the same way stay aligned
+    // in memory. At 2 MiB and above the range is also offered to transparent
+    // huge pages.
+    bool open(const std::string& path, size_t alignment = 0) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+
+        // mmap() rejects empty ranges; an empty file is simply an empty view.
+        if (size_ > 0) {
+            void* addr = alignment > static_cast<size_t>(sysconf(_SC_PAGESIZE))
+                ? mapAligned(fd, alignment)
+                : mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                size_ = 0;
+                return false;
+            }
+            data_ = static_cast<char*>(addr);
+#ifdef MADV_HUGEPAGE
+            if (alignment >= (2u << 20)) madvise(data_, size_, MADV_HUGEPAGE);
+#endif
+        }
+
+        // The mapping keeps its own reference to the file.
+        ::close(fd);
+        return true;
+    }
+
+    void close() {
+        if (data_) munmap(data_, size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    // Reserve `alignment` bytes more address space than needed, map the file
+    // over its first aligned address and give back the rest.
+    void* mapAligned(int fd, size_t alignment) {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t span = (size_ + page - 1) / page * page;
+        void* reserved = mmap(nullptr, span + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reserved == MAP_FAILED) return MAP_FAILED;
+
+        uintptr_t base = reinterpret_cast<uintptr_t>(reserved);
+        uintptr_t aligned = (base + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+        void* addr = mmap(reinterpret_cast<void*>(aligned), size_, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0);
+        if (addr == MAP_FAILED) {
+            munmap(reserved, span + alignment);
+            return MAP_FAILED;
+        }
+        if (aligned > base) munmap(reserved, aligned - base);
+        uintptr_t tail = aligned + span;
+        uintptr_t end = base + span + alignment;
+        if (end > tail) munmap(reinterpret_cast<void*>(tail), end - tail);
+        return addr;
+    }
+
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
@@ -0,0 +1,91 @@
+#include "model_cache.h"
+
+#include <cstdio>
+#include <iostream>
+
+#include <sys/stat.h>
+
+#include "mapped_file.h"
+#include "onnxruntime_c_api.h"
+#include "xxhash64.h"
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+std::string cpu_feature_string() {
+    std::string features;
+    auto add = [&](const char* name, bool supported) {
+        if (!supported) return;
+        if (!features.empty()) features += ",";
+        features += name;
+    };
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    add("sse4.2", __builtin_cpu_supports("sse4.2"));
+    add("avx", __builtin_cpu_supports("avx"));
+    add("avx2", __builtin_cpu_supports("avx2"));
+    add("fma", __builtin_cpu_supports("fma"));
+    add("f16c", __builtin_cpu_supports("f16c"));
+    add("avxvnni", __builtin_cpu_supports("avxvnni"));
+    add("avx512f", __builtin_cpu_supports("avx512f"));
+    add("avx512bw", __builtin_cpu_supports("avx512bw"));
+    add("avx512vl", __builtin_cpu_supports("avx512vl"));
+    add("avx512vnni", __builtin_cpu_supports("avx512vnni"));
+    add("avx512bf16", __builtin_cpu_supports("avx512bf16"));
+#elif defined(__aarch64__) && defined(__linux__)
+    char hwcap[64];
+    snprintf(hwcap, sizeof(hwcap), "hwcap=%lx,hwcap2=%lx", getauxval(AT_HWCAP), getauxval(AT_HWCAP2));
+    features = hwcap;
+#elif defined(__aarch64__)
+    features = "arm64";
+#endif
+
+    return features.empty() ? "generic" : features;
+}
+
+bool model_cache_key(const std::string& base_dir,
+                     const std::string& graph_path,
+                     const std::vector<std::string>& weight_files,
+                     bool weights_checksummed,
+                     const std::string& ort_version,
+                     std::string& key) {
+    // Describe every file on its own, then hash the list of (name, value)
+    // pairs, so renaming or re-pointing a weights file also changes the key.
+    std::string manifest;
+    {
+        MappedFile file;
+        if (!file.open(base_dir + "/" + graph_path)) {
+            std::cerr << "model cache: failed to read " << graph_path << "\n";
+            return false;
+        }
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(xxh64(file.data(), file.size())));
+        manifest += graph_path + ":" + hex + "\n";
+    }
+    if (!weights_checksummed) {
+        for (const auto& name : weight_files) {
+            struct stat st;
+            if (stat((base_dir + "/" + name).c_str(), &st) != 0) {
+                std::cerr << "model cache: failed to stat " << name << "\n";
+                return false;
+            }
+            char id[96];
+            snprintf(id, sizeof(id), "%llu:%lld.%09ld:%llu:%llu",
+                     static_cast<unsigned long long>(st.st_size), static_cast<long long>(st.st_mtim.tv_sec),
+                     static_cast<long>(st.st_mtim.tv_nsec), static_cast<unsigned long long>(st.st_dev),
+                     static_cast<unsigned long long>(st.st_ino));
+            manifest += name + ":" + id + "\n";
+        }
+    }
+
+    std::string cpu = cpu_feature_string();
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%016llx-ort%s-api%d-%08llx",
+             static_cast<unsigned long long>(xxh64(manifest.data(), manifest.size())),
+             ort_version.c_str(), ORT_API_VERSION,
+             static_cast<unsigned long long>(xxh64(cpu.data(), cpu.size()) & 0xffffffffULL));
+    key = buf;
+    return true;
+}
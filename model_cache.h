@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Optimized-model cache.
+//
+// An optimized ORT-format model is only valid for the exact graph and weights
+// it came from, the ORT build that produced it, and the CPU it was optimized
+// on (ORT_ENABLE_ALL applies layout and kernel choices that depend on the
+// instruction set). The cache key folds all of these together.
+//
+// Only graph.onnx is hashed in full. Hashing the weights would read all of
+// them on every start, the very cost the cache is there to save. When split
+// recorded a checksum for every external tensor, those checksums, and
+// the locations, offsets and lengths, are part of graph.onnx and its hash
+// already stands for the weights. Otherwise each weights file is keyed on
+// its size, modification time and inode.
+
+// Instruction set extensions relevant to ORT's CPU kernels, e.g.
+// "avx,avx2,fma,f16c".
+std::string cpu_feature_string();
+
+// Build the cache key for graph_path and the external data files it refers
+// to (relative to base_dir). `weights_checksummed` says whether graph_path
+// records a checksum for every external tensor. Returns false if one of the
+// files can't be read.
+bool model_cache_key(const std::string& base_dir,
+                     const std::string& graph_path,
+                     const std::vector<std::string>& weight_files,
+                     bool weights_checksummed,
+                     const std::string& ort_version,
+                     std::string& key);
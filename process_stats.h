@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Resident set size of this process right now, in bytes (0 if unknown).
+inline size_t current_rss_bytes() {
+#ifdef __linux__
+    FILE* f = std::fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long size = 0, resident = 0;
+    int n = std::fscanf(f, "%lu %lu", &size, &resident);
+    std::fclose(f);
+    return n == 2 ? resident * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+// Highest resident set size this process has reached, in bytes.
+inline size_t peak_rss_bytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);          // bytes on macOS
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;   // KiB elsewhere
+#endif
+}
+
+// Proportional set size: resident pages, with pages shared by N processes
+// counted 1/N each. Summing it across processes that share copy-on-write
+// memory gives their real footprint. Returns 0 if unknown.
+inline size_t proportional_set_size_bytes() {
+#ifdef __linux__
+    FILE* f = std::fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return 0;
+    char line[256];
+    size_t pss_kib = 0;
+    while (std::fgets(line, sizeof(line), f)) {
+        if (std::strncmp(line, "Pss:", 4) == 0) {
+            std::sscanf(line + 4, "%zu", &pss_kib);
+            break;
+        }
+    }
+    std::fclose(f);
+    return pss_kib * 1024;
+#else
+    return 0;
+#endif
+}
+
+// Number of threads in this process (0 if unknown).
+inline size_t thread_count() {
+#ifdef __linux__
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir) return 0;
+    size_t count = 0;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') count++;
+    }
+    closedir(dir);
+    return count;
+#else
+    return 0;
+#endif
+}
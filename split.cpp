@@ -1,75 +1,808 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "onnx.pb.h"
+#include "blob_store.h"
+#include "block_codec.h"
+#include "external_data.h"
+#include "graph_order.h"
+#include "half_convert.h"
+#include "process_stats.h"
+#include "stream_split.h"
+#include "tensor_index.h"
+#include "weights_writer.h"
+#include "xxhash64.h"
 
-void switch_tensor_to_external_data(onnx::TensorProto& tensor, const std::string& location) {
-    std::ofstream out(location, std::ios::binary | std::ios::app);
-    if (!out) throw std::runtime_error("Failed to open file: " + location);
+enum class FloatStore {
+    Fp32,  // float initializers are written as they are
+    Fp16,  // converted to IEEE half precision
+    Bf16,  // converted to bfloat16
+};
 
-    // Get offset by seeking to the end
-    out.seekp(0, std::ios::end);
-    size_t offset = out.tellp();
-    size_t length = tensor.raw_data().size();
-    out.write(tensor.raw_data().data(), length);
-    out.close();
+enum class Layout {
+    Model,     // tensors in the order the model file lists them
+    Consumer,  // tensors in the order the graph first reads them
+};
 
-    // set this tensor to have external data, loaded separately
-    tensor.set_data_location(onnx::TensorProto_DataLocation_EXTERNAL);
+enum class WidenMode {
+    Cast,  // retype the initializers and add Cast nodes back to float
+    Load,  // keep the graph in float, the loader widens while reading
+};
 
-    // and say where this data is
-    auto add_entry = [&](const std::string& key, const std::string& value) {
-        auto* entry = tensor.add_external_data();
-        entry->set_key(key);
-        entry->set_value(value);
-    };
+struct SplitOptions {
+    size_t size_threshold = 1024;  // smaller initializers stay in the graph
+    size_t shards = 1;             // external data files, balanced by size
+    FloatStore store = FloatStore::Fp32;
+    WidenMode widen = WidenMode::Cast;
+    Layout layout = Layout::Model;
+    Codec codec = Codec::None;
+    uint64_t block_size = 256 * 1024;  // uncompressed bytes per compressed block
+    std::string blob_store;  // directory shared by several models, empty: none
+    bool stream = false;     // walk the wire format instead of parsing the model
+    WriterOptions writer;
+};
+
+// Convert the float tensors among `tensors` to 16-bit storage.
+//
+// With WidenMode::Cast each converted initializer X is renamed and retyped,
+// and a Cast node at the top of the graph produces X in float again; ORT
+// folds those casts when it creates the session, so inference is unchanged
+// while the file and the page cache hold half the bytes. With
+// WidenMode::Load the graph keeps declaring float tensors and the model is
+// marked so that onnx_test widens them while loading.
+// Cast from bfloat16 arrived in opset 13. Returns the model's default-domain
+// opset when it is older than that, 0 otherwise.
+int64_t opset_before_bf16_cast(const onnx::ModelProto& model) {
+    for (const auto& opset : model.opset_import()) {
+        if ((opset.domain().empty() || opset.domain() == "ai.onnx") && opset.version() < 13) {
+            return opset.version();
+        }
+    }
+    return 0;
+}
+
+void store_floats_as_half(onnx::ModelProto& model, const std::vector<onnx::TensorProto*>& tensors,
+                          const SplitOptions& options) {
+    bool bf16 = options.store == FloatStore::Bf16;
+    const char* suffix = bf16 ? "_bf16" : "_fp16";
+    auto* graph = model.mutable_graph();
+
+    if (bf16 && options.widen == WidenMode::Cast && opset_before_bf16_cast(model) != 0) {
+        throw std::runtime_error("Casting from bfloat16 needs opset 13, the model uses opset "
+                                 + std::to_string(opset_before_bf16_cast(model)));
+    }
+
+    // Every name in use, so renamed initializers cannot collide
+    std::unordered_set<std::string> names;
+    std::unordered_set<std::string> graph_inputs;
+    for (const auto& input : graph->input()) {
+        names.insert(input.name());
+        graph_inputs.insert(input.name());
+    }
+    std::unordered_set<const onnx::TensorProto*> initializers;
+    for (const auto& tensor : graph->initializer()) {
+        names.insert(tensor.name());
+        initializers.insert(&tensor);
+    }
+    for (const auto& node : graph->node()) {
+        for (const auto& output : node.output()) names.insert(output);
+    }
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    size_t converted = 0, casts = 0;
+    uint64_t before = 0, after = 0;
+    for (onnx::TensorProto* tensor : tensors) {
+        if (tensor->data_type() != onnx::TensorProto_DataType_FLOAT) continue;
+        // An initializer that is also a graph input can be overridden by
+        // the caller, so it must keep its name and type.
+        if (options.widen == WidenMode::Cast && graph_inputs.count(tensor->name())) continue;
+        // Only the main graph's initializers can be renamed and fed through
+        // a Cast node; the loader widens every other tensor in Load mode.
+        if (options.widen == WidenMode::Cast && !initializers.count(tensor)) continue;
+
+        const std::string& raw = tensor->raw_data();
+        size_t count = raw.size() / sizeof(float);
+        std::vector<float> values(count);
+        std::memcpy(values.data(), raw.data(), count * sizeof(float));
+        std::string half(count * sizeof(uint16_t), '\0');
+        uint16_t* out = reinterpret_cast<uint16_t*>(&half[0]);
+        if (bf16) float_to_bfloat16(values.data(), out, count);
+        else float_to_half(values.data(), out, count);
+
+        before += raw.size();
+        after += half.size();
+        tensor->set_raw_data(std::move(half));
+        converted++;
+
+        if (options.widen == WidenMode::Load) continue;
+
+        std::string original = tensor->name();
+        std::string renamed = original + suffix;
+        while (names.count(renamed)) renamed += "_";
+        names.insert(renamed);
+        tensor->set_name(renamed);
+        tensor->set_data_type(bf16 ? onnx::TensorProto_DataType_BFLOAT16
+                                   : onnx::TensorProto_DataType_FLOAT16);
+
+        auto* cast = graph->add_node();
+        cast->set_op_type("Cast");
+        cast->set_name(original + "_widen");
+        cast->add_input(renamed);
+        cast->add_output(original);
+        auto* to = cast->add_attribute();
+        to->set_name("to");
+        to->set_type(onnx::AttributeProto_AttributeType_INT);
+        to->set_i(onnx::TensorProto_DataType_FLOAT);
+        casts++;
+    }
+
+    // The casts were appended; move them in front of their consumers
+    auto* nodes = graph->mutable_node();
+    std::rotate(nodes->begin(), nodes->end() - casts, nodes->end());
+
+    if (options.widen == WidenMode::Load && converted > 0) {
+        auto* entry = model.add_metadata_props();
+        entry->set_key(kFloatStorageKey);
+        entry->set_value(bf16 ? "bf16" : "fp16");
+    }
+
+    double elapsed_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - begin).count();
+    printf("Stored %zu float tensors as %s (%.1f MiB -> %.1f MiB) with %s in %0.02lfms, %s\n",
+           converted, bf16 ? "bf16" : "fp16", before / (1024.0 * 1024.0), after / (1024.0 * 1024.0),
+           bf16 ? "avx2/scalar" : half_convert_implementation(), elapsed_ms,
+           options.widen == WidenMode::Cast ? "widened by Cast nodes" : "widened by the loader");
+}
+
+// Store every entry of a repeated field in `raw` as an Element.
+template <typename Element, typename Field>
+void pack_field(const Field& field, std::string& raw) {
+    raw.resize(field.size() * sizeof(Element));
+    char* out = &raw[0];
+    for (const auto& value : field) {
+        Element element = static_cast<Element>(value);
+        std::memcpy(out, &element, sizeof(Element));
+        out += sizeof(Element);
+    }
+}
+
+// Move a tensor's values from its typed repeated field (float_data,
+// int64_data, ...) to raw_data, as the little-endian bytes ONNX specifies.
+// raw_data parses as a single block, and only raw_data can go external.
+// Returns false if there was nothing to move, or for strings and 4-bit
+// types, which are left alone.
+bool pack_typed_fields(onnx::TensorProto& tensor) {
+    if (tensor.has_raw_data()) return false;
+    std::string raw;
+    switch (tensor.data_type()) {
+        case onnx::TensorProto_DataType_FLOAT:
+        case onnx::TensorProto_DataType_COMPLEX64:
+            if (tensor.float_data_size() == 0) return false;
+            pack_field<float>(tensor.float_data(), raw);
+            tensor.clear_float_data();
+            break;
+        case onnx::TensorProto_DataType_DOUBLE:
+        case onnx::TensorProto_DataType_COMPLEX128:
+            if (tensor.double_data_size() == 0) return false;
+            pack_field<double>(tensor.double_data(), raw);
+            tensor.clear_double_data();
+            break;
+        case onnx::TensorProto_DataType_INT64:
+            if (tensor.int64_data_size() == 0) return false;
+            pack_field<int64_t>(tensor.int64_data(), raw);
+            tensor.clear_int64_data();
+            break;
+        case onnx::TensorProto_DataType_UINT64:
+            if (tensor.uint64_data_size() == 0) return false;
+            pack_field<uint64_t>(tensor.uint64_data(), raw);
+            tensor.clear_uint64_data();
+            break;
+        case onnx::TensorProto_DataType_UINT32:
+            if (tensor.uint64_data_size() == 0) return false;
+            pack_field<uint32_t>(tensor.uint64_data(), raw);
+            tensor.clear_uint64_data();
+            break;
+        case onnx::TensorProto_DataType_INT32:
+            if (tensor.int32_data_size() == 0) return false;
+            pack_field<int32_t>(tensor.int32_data(), raw);
+            tensor.clear_int32_data();
+            break;
+        // int32_data holds one narrower value per entry; fp16 and bf16 as bits
+        case onnx::TensorProto_DataType_INT16:
+        case onnx::TensorProto_DataType_UINT16:
+        case onnx::TensorProto_DataType_FLOAT16:
+        case onnx::TensorProto_DataType_BFLOAT16:
+            if (tensor.int32_data_size() == 0) return false;
+            pack_field<uint16_t>(tensor.int32_data(), raw);
+            tensor.clear_int32_data();
+            break;
+        case onnx::TensorProto_DataType_INT8:
+        case onnx::TensorProto_DataType_UINT8:
+        case onnx::TensorProto_DataType_BOOL:
+        case onnx::TensorProto_DataType_FLOAT8E4M3FN:
+        case onnx::TensorProto_DataType_FLOAT8E4M3FNUZ:
+        case onnx::TensorProto_DataType_FLOAT8E5M2:
+        case onnx::TensorProto_DataType_FLOAT8E5M2FNUZ:
+            if (tensor.int32_data_size() == 0) return false;
+            pack_field<uint8_t>(tensor.int32_data(), raw);
+            tensor.clear_int32_data();
+            break;
+        default:
+            return false;
+    }
+    tensor.set_raw_data(std::move(raw));
+    return true;
+}
+
+// Size of one element of `data_type`, the stride byte shuffling works on.
+size_t element_size_of(int32_t data_type) {
+    switch (data_type) {
+        case onnx::TensorProto_DataType_DOUBLE:
+        case onnx::TensorProto_DataType_INT64:
+        case onnx::TensorProto_DataType_UINT64:
+        case onnx::TensorProto_DataType_COMPLEX64:
+            return 8;
+        case onnx::TensorProto_DataType_FLOAT:
+        case onnx::TensorProto_DataType_INT32:
+        case onnx::TensorProto_DataType_UINT32:
+            return 4;
+        case onnx::TensorProto_DataType_FLOAT16:
+        case onnx::TensorProto_DataType_BFLOAT16:
+        case onnx::TensorProto_DataType_INT16:
+        case onnx::TensorProto_DataType_UINT16:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// For each tensor, the index of the first one with the same payload (its
+// own index if it is the first). Tied embeddings and repeated constants
+// are then stored once. `hashes` receives the XXH64 of every payload, for
+// the writer to reuse.
+std::vector<size_t> find_duplicates(const std::vector<onnx::TensorProto*>& tensors,
+                                    std::vector<uint64_t>& hashes) {
+    std::vector<size_t> same_as(tensors.size());
+    hashes.resize(tensors.size());
+    std::unordered_multimap<uint64_t, size_t> by_hash;
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const std::string& raw = tensors[i]->raw_data();
+        uint64_t hash = xxh64(raw.data(), raw.size());
+        hashes[i] = hash;
+        same_as[i] = i;
+        auto range = by_hash.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (tensors[it->second]->raw_data() == raw) {
+                same_as[i] = it->second;
+                break;
+            }
+        }
+        if (same_as[i] == i) by_hash.emplace(hash, i);
+    }
+    return same_as;
+}
+
+// Replace the payload of every tensor with its block-compressed form,
+// returning the layout of each so it can be recorded next to its location.
+// Duplicates reuse the compressed form of the first copy.
+std::vector<BlockLayout> compress_tensors(const std::vector<onnx::TensorProto*>& tensors,
+                                          const std::vector<size_t>& same_as,
+                                          const SplitOptions& options) {
+    auto begin = std::chrono::high_resolution_clock::now();
+    std::vector<BlockLayout> layouts(tensors.size());
+    uint64_t before = 0, after = 0;
+    size_t blocks = 0;
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        BlockLayout& layout = layouts[i];
+        if (same_as[i] != i) {
+            layout = layouts[same_as[i]];
+            tensors[i]->set_raw_data(tensors[same_as[i]]->raw_data());
+            continue;
+        }
+        layout.codec = options.codec;
+        layout.block_size = options.block_size;
+        // Tensors widened by the loader are stored as 16-bit values
+        layout.element_size = tensors[i]->data_type() == onnx::TensorProto_DataType_FLOAT
+                                      && options.store != FloatStore::Fp32
+                                      && options.widen == WidenMode::Load
+                                  ? 2 : element_size_of(tensors[i]->data_type());
+
+        const std::string& raw = tensors[i]->raw_data();
+        std::string stored;
+        compress_blocks(raw.data(), raw.size(), layout, stored, options.writer.threads);
+        before += raw.size();
+        after += stored.size();
+        blocks += layout.blocks.size();
+        tensors[i]->set_raw_data(std::move(stored));
+    }
+
+    double elapsed_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - begin).count();
+    const char* codec = options.codec == Codec::Lz4 ? "lz4"
+                      : options.codec == Codec::ShuffleLz4 ? "shuffle+lz4" : "shuffle+rans";
+    printf("Compressed %zu tensors in %zu blocks with %s (%.1f MiB -> %.1f MiB, %.1f%%) in %0.02lfms\n",
+           tensors.size(), blocks, codec, before / (1024.0 * 1024.0),
+           after / (1024.0 * 1024.0), before ? 100.0 * after / before : 0.0, elapsed_ms);
+    return layouts;
+}
+
+// How well a layout serves a load that reads the tensors in consumer order.
+struct Locality {
+    size_t jumps = 0;          // reads not starting within readahead of the previous one
+    uint64_t jump_bytes = 0;   // distance covered by those jumps
+    uint64_t sequential = 0;   // bytes read right after the previous read
+    uint64_t total = 0;
+};
+
+// Kernel readahead window by default: a read starting less than this past
+// the previous one is served by the same readahead stream.
+constexpr uint64_t kReadaheadWindow = 128 * 1024;
 
-    add_entry("location", location);
-    add_entry("offset", std::to_string(offset));
-    add_entry("length", std::to_string(length));
+// Lay the tensors out in `layout` order, as the writers would (duplicates
+// share the first copy), then walk them in `consumer` order, counting the
+// reads that leave the current readahead stream.
+Locality measure_locality(const std::vector<onnx::TensorProto*>& tensors, const std::vector<size_t>& same_as,
+                          const std::vector<size_t>& shard_of, const std::vector<size_t>& layout,
+                          const std::vector<size_t>& consumer, size_t alignment) {
+    std::vector<uint64_t> offset(tensors.size(), 0);
+    std::vector<bool> placed(tensors.size(), false);
+    std::vector<uint64_t> end(*std::max_element(shard_of.begin(), shard_of.end()) + 1, 0);
+    for (size_t i : layout) {
+        size_t first = same_as[i];
+        if (!placed[first]) {
+            uint64_t& shard_end = end[shard_of[first]];
+            offset[first] = (shard_end + alignment - 1) / alignment * alignment;
+            shard_end = offset[first] + tensors[first]->raw_data().size();
+            placed[first] = true;
+        }
+        offset[i] = offset[first];
+    }
+
+    // A duplicate read again is served from the page cache
+    Locality locality;
+    std::vector<uint64_t> last(end.size(), 0);
+    std::vector<bool> started(end.size(), false);
+    std::vector<bool> read(tensors.size(), false);
+    for (size_t i : consumer) {
+        if (read[same_as[i]]) continue;
+        read[same_as[i]] = true;
+        uint64_t size = tensors[i]->raw_data().size();
+        uint64_t& previous = last[shard_of[i]];
+        locality.total += size;
+        if (!started[shard_of[i]] || (offset[i] >= previous && offset[i] - previous <= kReadaheadWindow)) {
+            locality.sequential += size;
+        } else {
+            locality.jumps++;
+            locality.jump_bytes += offset[i] > previous ? offset[i] - previous : previous - offset[i];
+        }
+        started[shard_of[i]] = true;
+        previous = offset[i] + size;
+    }
+    return locality;
+}
+
+void print_locality(const char* label, const Locality& locality) {
+    printf("Locality with %s layout: %zu jumps over %.1f MiB, %.1f%% of %.1f MiB read sequentially\n",
+           label, locality.jumps, locality.jump_bytes / (1024.0 * 1024.0),
+           locality.total ? 100.0 * locality.sequential / locality.total : 100.0,
+           locality.total / (1024.0 * 1024.0));
+}
 
-    // clear embedded payload from the tensor, making it minuscule
-    tensor.clear_raw_data();
+// Name of shard `index` (0-based) out of `count`; a single shard keeps the
+// plain name.
+std::string shard_location(const std::string& location, size_t index, size_t count) {
+    if (count <= 1) return location;
+    size_t dot = location.rfind('.');
+    std::string stem = dot == std::string::npos ? location : location.substr(0, dot);
+    std::string ext = dot == std::string::npos ? "" : location.substr(dot);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%05zu-of-%05zu", index + 1, count);
+    return stem + suffix + ext;
 }
 
+// Remove `location` and its shards, whatever their count, left by an earlier
+// run: this run may write fewer shards, or only link `location` into a blob
+// store. Removing it also keeps the writer from truncating a store's pack file
+// through an old link.
+void remove_weights_files(const std::string& location) {
+    std::remove(location.c_str());
+    size_t slash = location.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : location.substr(0, slash);
+    std::string base = slash == std::string::npos ? location : location.substr(slash + 1);
+    size_t dot = base.rfind('.');
+    std::string stem = dot == std::string::npos ? base : base.substr(0, dot);
+    std::string ext = dot == std::string::npos ? "" : base.substr(dot);
+
+    DIR* listing = opendir(dir.c_str());
+    if (!listing) return;
+    std::vector<std::string> shards;
+    while (const dirent* entry = readdir(listing)) {
+        std::string name = entry->d_name;
+        if (name.size() > stem.size() + ext.size() && name.compare(0, stem.size() + 1, stem + "-") == 0
+            && name.compare(name.size() - ext.size(), ext.size(), ext) == 0
+            && name.find("-of-", stem.size()) != std::string::npos) {
+            shards.push_back(name);
+        }
+    }
+    closedir(listing);
+    for (const auto& name : shards) std::remove((dir + "/" + name).c_str());
+}
+
+// With `store` set the weights go to its pack file, which must be opened
+// with options.blob_store and options.writer.alignment.
 void convert_model_to_use_external_data(
     onnx::ModelProto& model,
     const std::string& location,
-    size_t size_threshold = 1024
+    const SplitOptions& options,
+    BlobStore* store
 ) {
-    auto* graph = model.mutable_graph();
+    // Rank tensors by their first consumer before Cast nodes are added
+    std::unordered_map<const onnx::TensorProto*, size_t> consumer_rank;
+    for (onnx::TensorProto* tensor : tensors_in_consumer_order(model)) {
+        consumer_rank.emplace(tensor, consumer_rank.size());
+    }
 
-    // loop over all initializers, and switch them to external if they are big
-    // enough
-    for (auto& tensor : *graph->mutable_initializer()) {
-        if (!tensor.has_raw_data()) {
+    // loop over every tensor that can live outside the graph, move typed
+    // fields to raw_data, and pick those big enough to go external
+    std::vector<onnx::TensorProto*> tensors;
+    size_t packed = 0;
+    for (onnx::TensorProto* tensor : model_tensors(model)) {
+        if (tensor->data_location() == onnx::TensorProto_DataLocation_EXTERNAL) {
+          continue;
+        }
+        if (pack_typed_fields(*tensor)) {
+          packed++;
+        }
+        if (!tensor->has_raw_data()) {
           continue;
         }
-        if (tensor.raw_data().size() < size_threshold) {
+        if (tensor->raw_data().size() < options.size_threshold) {
           continue;
         }
-        switch_tensor_to_external_data(tensor, location);
+        tensors.push_back(tensor);
+    }
+    if (packed > 0) printf("Moved %zu tensors from typed fields to raw_data\n", packed);
+
+    if (options.store != FloatStore::Fp32) store_floats_as_half(model, tensors, options);
+
+    std::vector<size_t> same_as(tensors.size());
+    for (size_t i = 0; i < same_as.size(); ++i) same_as[i] = i;
+    std::vector<uint64_t> hashes;
+    if (options.writer.dedup) same_as = find_duplicates(tensors, hashes);
+
+    std::vector<BlockLayout> layouts;
+    if (options.codec != Codec::None) {
+        layouts = compress_tensors(tensors, same_as, options);
+        hashes.clear();  // the writer hashes the compressed payloads
+    }
+
+    // Balance the shards by size: largest tensors first, each to the
+    // lightest shard so far. Within a shard tensors keep the layout's order.
+    // Duplicates follow their first copy, so the writer can store them once.
+    size_t shard_count = std::max<size_t>(1, options.shards);
+    std::vector<size_t> shard_of(tensors.size(), 0);
+    if (shard_count > 1) {
+        std::vector<size_t> by_size;
+        for (size_t i = 0; i < tensors.size(); ++i) {
+            if (same_as[i] == i) by_size.push_back(i);
+        }
+        std::stable_sort(by_size.begin(), by_size.end(), [&](size_t a, size_t b) {
+            return tensors[a]->raw_data().size() > tensors[b]->raw_data().size();
+        });
+        std::vector<uint64_t> load(shard_count, 0);
+        for (size_t i : by_size) {
+            size_t lightest = std::min_element(load.begin(), load.end()) - load.begin();
+            shard_of[i] = lightest;
+            load[lightest] += tensors[i]->raw_data().size();
+        }
+        for (size_t i = 0; i < tensors.size(); ++i) shard_of[i] = shard_of[same_as[i]];
+    }
+
+    // With a blob store the single weights file is the store's pack file,
+    // which only receives the payloads it does not hold yet
+    std::vector<WeightsWriter> writers;
+    if (store) {
+        if (shard_count > 1) throw std::runtime_error("--blob-store keeps a single pack file, drop --shards");
+        WriterOptions writer_options = options.writer;
+        writer_options.append = true;
+        writers.emplace_back(store->pack_path(), location, writer_options);
+        store->seed(writers.back());
+    } else {
+        for (size_t s = 0; s < shard_count; ++s) {
+            std::string name = shard_location(location, s, shard_count);
+            writers.emplace_back(name, name, options.writer);
+        }
+    }
+
+    // Report how both layouts serve a load in consumer order, then write
+    // the chosen one
+    std::vector<size_t> model_order(tensors.size());
+    for (size_t i = 0; i < model_order.size(); ++i) model_order[i] = i;
+    std::vector<size_t> consumer_order = model_order;
+    // Tensors no node consumes go after every consumed one, in model order
+    auto rank_of = [&](size_t i) {
+        auto it = consumer_rank.find(tensors[i]);
+        return it == consumer_rank.end() ? SIZE_MAX : it->second;
+    };
+    std::stable_sort(consumer_order.begin(), consumer_order.end(), [&](size_t a, size_t b) {
+        return rank_of(a) < rank_of(b);
+    });
+    if (!tensors.empty()) {
+        print_locality("model", measure_locality(tensors, same_as, shard_of, model_order, consumer_order,
+                                                 options.writer.alignment));
+        print_locality("consumer", measure_locality(tensors, same_as, shard_of, consumer_order, consumer_order,
+                                                    options.writer.alignment));
+    }
+
+    for (size_t i : options.layout == Layout::Consumer ? consumer_order : model_order) {
+        if (hashes.empty()) {
+            writers[shard_of[i]].add(*tensors[i]);
+        } else {
+            writers[shard_of[i]].add(*tensors[i], hashes[i]);
+        }
+        if (layouts.empty()) continue;
+
+        // "length" is the stored size, the layout gives the rest
+        const BlockLayout& layout = layouts[i];
+        auto add_entry = [&](const std::string& key, const std::string& value) {
+            auto* entry = tensors[i]->add_external_data();
+            entry->set_key(key);
+            entry->set_value(value);
+        };
+        add_entry("compression", codec_name(layout));
+        add_entry("block_size", std::to_string(layout.block_size));
+        add_entry("raw_length", std::to_string(layout.raw_length));
+        add_entry("blocks", format_block_sizes(layout.blocks));
+    }
+
+    uint64_t padding = 0;
+    for (size_t s = 0; s < shard_count; ++s) {
+        WriterStats stats;
+        writers[s].finish(&stats);
+        padding += stats.padding;
+        printf("Wrote %zu tensors (%.1f MiB) to %s in %zu writes on %u threads in %0.02lfms\n",
+               stats.tensors, stats.bytes / (1024.0 * 1024.0),
+               store ? store->pack_path().c_str() : shard_location(location, s, shard_count).c_str(),
+               stats.writes, stats.threads, stats.elapsed_ms);
+        if (stats.duplicates > 0) {
+            printf("Deduplicated %zu tensors, %.1f MiB not written\n",
+                   stats.duplicates, stats.saved / (1024.0 * 1024.0));
+        }
+    }
+    if (store) {
+        store->commit(writers[0], location);
+        printf("Linked %s to blob store %s, now %zu blobs\n",
+               location.c_str(), options.blob_store.c_str(), store->size());
+    }
+
+    // Record the alignment so loaders can rely on it
+    auto* entry = model.add_metadata_props();
+    entry->set_key(kExternalDataAlignmentKey);
+    entry->set_value(std::to_string(options.writer.alignment));
+    std::cout << "Aligned tensors to " << options.writer.alignment << " bytes, "
+              << padding << " bytes of padding\n";
+}
+
+void printUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --align=N            start every tensor on an N-byte boundary, N a power of two\n"
+              << "                       such as 64, 4k or 2m (default: 4k)\n"
+              << "  --shards=N           spread the weights over N files (at most 1024),\n"
+              << "                       weights-0000i-of-0000N.data\n"
+              << "  --store=fp32|fp16|bf16 precision float weights are stored in (default: fp32)\n"
+              << "  --widen=cast|load    with --store=fp16|bf16, widen back to float through Cast nodes\n"
+              << "                       in the graph, or in onnx_test while loading (default: cast)\n"
+              << "  --compress=none|lz4|shuffle-lz4|shuffle-rans\n"
+              << "                       compress the weights in blocks, byte-shuffled by element size\n"
+              << "                       for the shuffle codecs; loadable with --load=inline|lowpeak only\n"
+              << "  --block-size=N       uncompressed bytes per compressed block (default: 256k)\n"
+              << "  --layout=model|consumer order of the tensors in the weights file: as the model lists\n"
+              << "                       them, or as the graph first reads them (default: model)\n"
+              << "  --dedup=on|off       store identical tensors once (default: on)\n"
+              << "  --blob-store=DIR     append the weights to a pack file shared by several models,\n"
+              << "                       storing only tensors it does not hold yet; weights.data\n"
+              << "                       becomes a symlink to it\n"
+              << "  --stream             copy the weights out without parsing the whole model, in constant\n"
+              << "                       memory; implied for models over 2 GiB. Only top-level raw_data\n"
+              << "                       initializers are externalized, and only --align applies\n"
+              << "  --threads=N          threads compressing, checksumming and writing weights\n"
+              << "                       (default: one per core, max 8)\n";
+}
+
+// Accepts a plain byte count or one suffixed with k or m
+bool parseSize(const std::string& value, size_t& out) {
+    // stoull would take leading blanks and a sign, wrapping "-1" to 2^64 - 1
+    if (value.empty() || value[0] < '0' || value[0] > '9') return false;
+    size_t pos = 0;
+    unsigned long long n = 0;
+    try {
+        n = std::stoull(value, &pos);
+    } catch (const std::exception&) {
+        return false;
+    }
+    std::string suffix = value.substr(pos);
+    int shift = 0;
+    if (suffix == "k" || suffix == "K") shift = 10;
+    else if (suffix == "m" || suffix == "M") shift = 20;
+    else if (!suffix.empty()) return false;
+    if (n > (std::numeric_limits<size_t>::max() >> shift)) return false;
+    out = static_cast<size_t>(n) << shift;
+    return true;
+}
+
+bool parseArgs(int argc, char** argv, SplitOptions& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string key = arg.substr(0, arg.find('='));
+        std::string value = arg.find('=') == std::string::npos ? "" : arg.substr(arg.find('=') + 1);
+
+        if (key == "--align" && parseSize(value, opts.writer.alignment)
+            && opts.writer.alignment > 0 && (opts.writer.alignment & (opts.writer.alignment - 1)) == 0) {
+            continue;
+        }
+        size_t shards = 0;
+        if (key == "--shards" && parseSize(value, shards) && shards > 0 && shards <= 1024) {
+            opts.shards = shards;
+            continue;
+        }
+        if (key == "--store" && (value == "fp32" || value == "fp16" || value == "bf16")) {
+            opts.store = value == "fp16" ? FloatStore::Fp16
+                       : value == "bf16" ? FloatStore::Bf16 : FloatStore::Fp32;
+            continue;
+        }
+        if (key == "--widen" && (value == "cast" || value == "load")) {
+            opts.widen = value == "cast" ? WidenMode::Cast : WidenMode::Load;
+            continue;
+        }
+        if (key == "--compress"
+            && (value == "none" || value == "lz4" || value == "shuffle-lz4" || value == "shuffle-rans")) {
+            opts.codec = value == "lz4" ? Codec::Lz4
+                       : value == "shuffle-lz4" ? Codec::ShuffleLz4
+                       : value == "shuffle-rans" ? Codec::ShuffleRans : Codec::None;
+            continue;
+        }
+        size_t block_size = 0;
+        if (key == "--block-size" && parseSize(value, block_size) && block_size > 0
+            && block_size <= (1u << 30)) {
+            opts.block_size = block_size;
+            continue;
+        }
+        if (key == "--layout" && (value == "model" || value == "consumer")) {
+            opts.layout = value == "model" ? Layout::Model : Layout::Consumer;
+            continue;
+        }
+        if (key == "--dedup" && (value == "on" || value == "off")) {
+            opts.writer.dedup = value == "on";
+            continue;
+        }
+        if (key == "--blob-store" && !value.empty()) {
+            opts.blob_store = value;
+            continue;
+        }
+        if (key == "--stream" && value.empty()) {
+            opts.stream = true;
+            continue;
+        }
+        size_t threads = 0;
+        if (key == "--threads" && parseSize(value, threads) && threads <= 1024) {
+            opts.writer.threads = static_cast<unsigned>(threads);
+            continue;
+        }
+        std::cerr << "Unknown argument: " << arg << "\n";
+        printUsage(argv[0]);
+        return false;
+    }
+    if (!opts.blob_store.empty() && opts.shards > 1) {
+        std::cerr << "--blob-store keeps a single pack file, drop --shards\n";
+        printUsage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+// Written once graph.onnx is complete: the index records its hash, which
+// loaders compare to tell a stale index apart.
+void writeTensorIndex(const TensorIndexWriter& index) {
+    index.write(kTensorIndexFile, "graph.onnx");
+    printf("Indexed %zu tensors in %s\n", index.size(), kTensorIndexFile);
+}
+
+// Models protobuf cannot parse in one piece
+constexpr uint64_t kMaxParsedModelSize = (uint64_t(2) << 30) - 1;
+
+int runStreamSplit(const SplitOptions& opts) {
+    if (opts.shards != 1 || opts.store != FloatStore::Fp32 || opts.codec != Codec::None
+        || opts.layout != Layout::Model || !opts.blob_store.empty()) {
+        std::cerr << "--shards, --store, --compress, --layout and --blob-store need the parsed model,"
+                  << " which --stream (and any model over 2 GiB) avoids\n";
+        return 1;
     }
+
+    StreamSplitOptions options;
+    options.size_threshold = opts.size_threshold;
+    options.alignment = opts.writer.alignment;
+    StreamSplitStats stats;
+    TensorIndexWriter index;
+    options.index = &index;
+    std::remove("graph.onnx");
+    std::remove(kTensorIndexFile);
+    remove_weights_files("weights.data");
+    stream_split("model.onnx", "graph.onnx", "weights.data", "weights.data", options, &stats);
+    printf("Streamed %zu tensors (%.1f MiB) to weights.data, kept %zu inline, %.1f MiB model -> %.1f KiB graph"
+           " in %0.02lfms, peak RSS %.1f MiB\n",
+           stats.tensors, stats.bytes / (1024.0 * 1024.0), stats.inline_tensors,
+           stats.model_bytes / (1024.0 * 1024.0), stats.graph_bytes / 1024.0, stats.elapsed_ms,
+           peak_rss_bytes() / (1024.0 * 1024.0));
+    std::cout << "Aligned tensors to " << options.alignment << " bytes, "
+              << stats.padding << " bytes of padding\n";
+    writeTensorIndex(index);
+    return 0;
 }
 
-int main() {
+int runSplit(const SplitOptions& opts) {
+    struct stat st;
+    if (opts.stream || (::stat("model.onnx", &st) == 0 && static_cast<uint64_t>(st.st_size) > kMaxParsedModelSize)) {
+        return runStreamSplit(opts);
+    }
+
     onnx::ModelProto model;
     std::ifstream in("model.onnx", std::ios::binary);
-    model.ParseFromIstream(&in);
+    if (!in || !model.ParseFromIstream(&in)) {
+        std::cerr << "Failed to load model.onnx\n";
+        return 1;
+    }
     in.close();
 
-    // remove previously created file
+    if (opts.store == FloatStore::Bf16 && opts.widen == WidenMode::Cast && opset_before_bf16_cast(model) != 0) {
+        std::cerr << "--store=bf16 --widen=cast needs opset 13 to Cast from bfloat16, model.onnx uses opset "
+                  << opset_before_bf16_cast(model) << "; use --widen=load or --store=fp16\n";
+        return 1;
+    }
+
+    // Open the blob store first: a store this run cannot use must not cost
+    // the outputs of the previous one
+    std::unique_ptr<BlobStore> store;
+    if (!opts.blob_store.empty()) store.reset(new BlobStore(opts.blob_store, opts.writer.alignment));
+
+    // remove previously created files
     std::remove("graph.onnx");
-    std::remove("weights.data");
+    std::remove(kTensorIndexFile);
+    remove_weights_files("weights.data");
 
-    // this modifies `model` to save the data into `weights.data` when it is
-    // over 1024 bytes.
-    convert_model_to_use_external_data(model, "weights.data", 1024);
+    // this modifies `model` to save the data into `weights.data` (or its
+    // shards) when it is over 1024 bytes.
+    convert_model_to_use_external_data(model, "weights.data", opts, store.get());
 
     // And we can serialize the model back, it will be very small
     std::ofstream out("graph.onnx", std::ios::binary);
     model.SerializeToOstream(&out);
     out.close();
 
+    TensorIndexWriter index;
+    for (const auto* tensor : model_tensors(model)) index.add(*tensor);
+    writeTensorIndex(index);
     return 0;
 }
+
+int main(int argc, char** argv) {
+    SplitOptions opts;
+    if (!parseArgs(argc, argv, opts)) return 1;
+    try {
+        return runSplit(opts);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
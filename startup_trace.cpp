@@ -0,0 +1,172 @@
+#include "startup_trace.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "process_stats.h"
+
+namespace {
+
+struct Sample {
+    double wall_us = 0;
+    double cpu_us = 0;
+    long minflt = 0;
+    long majflt = 0;
+    uint64_t rchar = 0;       // bytes passed through read()-like syscalls
+    uint64_t read_bytes = 0;  // bytes fetched from storage, page faults included
+    size_t rss = 0;
+};
+
+struct Span {
+    std::string name;
+    int parent = -1;
+    size_t tid = 0;
+    Sample begin;
+    Sample end;
+    bool open = true;
+};
+
+const auto g_epoch = std::chrono::steady_clock::now();
+std::mutex g_mutex;
+std::vector<Span> g_spans;
+thread_local std::vector<int> t_stack;
+
+// Cumulative I/O counters of this process, from /proc/self/io where available.
+void read_io_counters(uint64_t& rchar, uint64_t& read_bytes) {
+    rchar = read_bytes = 0;
+#ifdef __linux__
+    FILE* f = std::fopen("/proc/self/io", "r");
+    if (!f) return;
+    char key[64];
+    unsigned long long value;
+    while (std::fscanf(f, "%63[^:]: %llu\n", key, &value) == 2) {
+        if (std::string(key) == "rchar") rchar = value;
+        else if (std::string(key) == "read_bytes") read_bytes = value;
+    }
+    std::fclose(f);
+#endif
+}
+
+Sample take_sample() {
+    Sample s;
+    s.wall_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - g_epoch).count();
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        s.cpu_us = usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec
+                 + usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+        s.minflt = usage.ru_minflt;
+        s.majflt = usage.ru_majflt;
+    }
+    read_io_counters(s.rchar, s.read_bytes);
+    s.rss = current_rss_bytes();
+    return s;
+}
+
+std::string escape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+// A time for the JSON output with three decimals whatever its magnitude; the
+// stream's default 6 significant digits would round late spans off.
+std::string fixed3(double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", value);
+    return buf;
+}
+
+// Metrics of a closed span as the members of a JSON object.
+std::string metrics(const Span& span) {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"minor_faults\": %ld, \"major_faults\": %ld, "
+             "\"bytes_read\": %" PRIu64 ", \"storage_bytes_read\": %" PRIu64 ", \"rss_delta_bytes\": %lld",
+             (span.end.wall_us - span.begin.wall_us) / 1000.0,
+             (span.end.cpu_us - span.begin.cpu_us) / 1000.0,
+             span.end.minflt - span.begin.minflt,
+             span.end.majflt - span.begin.majflt,
+             span.end.rchar - span.begin.rchar,
+             span.end.read_bytes - span.begin.read_bytes,
+             static_cast<long long>(span.end.rss) - static_cast<long long>(span.begin.rss));
+    return buf;
+}
+
+void write_tree(std::ostream& out, int parent, const std::string& indent) {
+    bool first = true;
+    for (size_t i = 0; i < g_spans.size(); ++i) {
+        const Span& span = g_spans[i];
+        if (span.parent != parent || span.open) continue;
+        out << (first ? "" : ",") << "\n" << indent << "{\"name\": \"" << escape(span.name) << "\", "
+            << "\"start_ms\": " << fixed3(span.begin.wall_us / 1000.0) << ", " << metrics(span)
+            << ", \"children\": [";
+        write_tree(out, static_cast<int>(i), indent + "  ");
+        out << "]}";
+        first = false;
+    }
+}
+
+} // namespace
+
+void trace_begin(const char* name) {
+    Sample sample = take_sample();
+    std::lock_guard<std::mutex> lock(g_mutex);
+    Span span;
+    span.name = name;
+    span.parent = t_stack.empty() ? -1 : t_stack.back();
+    span.tid = std::hash<std::thread::id>()(std::this_thread::get_id()) % 100000;
+    span.begin = sample;
+    g_spans.push_back(span);
+    t_stack.push_back(static_cast<int>(g_spans.size() - 1));
+}
+
+double trace_end() {
+    Sample sample = take_sample();
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (t_stack.empty()) return 0.0;
+    Span& span = g_spans[t_stack.back()];
+    t_stack.pop_back();
+    span.end = sample;
+    span.open = false;
+    return (span.end.wall_us - span.begin.wall_us) / 1000.0;
+}
+
+bool trace_write_json(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) return false;
+    std::lock_guard<std::mutex> lock(g_mutex);
+    out << "{\"spans\": [";
+    write_tree(out, -1, "  ");
+    out << "\n]}\n";
+    return out.good();
+}
+
+bool trace_write_chrome(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) return false;
+    std::lock_guard<std::mutex> lock(g_mutex);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    bool first = true;
+    for (const Span& span : g_spans) {
+        if (span.open) continue;
+        out << (first ? "" : ",") << "\n  {\"name\": \"" << escape(span.name) << "\", \"ph\": \"X\", "
+            << "\"pid\": " << getpid() << ", \"tid\": " << span.tid << ", "
+            << "\"ts\": " << fixed3(span.begin.wall_us) << ", "
+            << "\"dur\": " << fixed3(span.end.wall_us - span.begin.wall_us) << ", "
+            << "\"args\": {" << metrics(span) << "}}";
+        first = false;
+    }
+    out << "\n]}\n";
+    return out.good();
+}
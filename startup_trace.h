@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// Startup tracer.
+//
+// Records nested spans; for each one the wall time, process CPU time (all
+// threads), minor/major page faults, bytes read and RSS change are captured
+// between its begin and end. The finished tree can be written as JSON, or as
+// a Chrome trace (chrome://tracing, Perfetto).
+
+// Open a span nested in the calling thread's innermost open span.
+void trace_begin(const char* name);
+
+// Close the calling thread's innermost open span; returns its wall time in ms.
+double trace_end();
+
+bool trace_write_json(const std::string& path);
+bool trace_write_chrome(const std::string& path);
+
+// Scoped span that also prints its wall time when it closes.
+struct AutoTime {
+  AutoTime(const char* str)
+  : str(str) { trace_begin(str); }
+  ~AutoTime() {
+    printf("%s: %0.02lfms\n", str, trace_end());
+  }
+  const char* str;
+};
@@ -0,0 +1,300 @@
+#include "stream_split.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "onnx.pb.h"
+#include "crc32c.h"
+#include "external_data.h"
+#include "tensor_index.h"
+
+namespace {
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::FileInputStream;
+using google::protobuf::io::StringOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+bool is_length_delimited(uint32_t tag) {
+    return WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+}
+
+// Appends a length-delimited field to `out`.
+void append_field(std::string& out, int field, const std::string& value) {
+    StringOutputStream stream(&out);
+    CodedOutputStream coded(&stream);
+    coded.WriteTag(WireFormatLite::MakeTag(field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+    coded.WriteVarint64(value.size());
+    coded.WriteRaw(value.data(), static_cast<int>(value.size()));
+}
+
+// Copies the field whose tag was just read from `in` to the end of `out`,
+// tag included.
+bool copy_field(CodedInputStream& in, uint32_t tag, std::string& out) {
+    StringOutputStream stream(&out);
+    CodedOutputStream coded(&stream);
+    return WireFormatLite::SkipField(&in, tag, &coded);
+}
+
+// Sequential writer for the weights file.
+class WeightsSink {
+public:
+    WeightsSink(const std::string& path, size_t alignment)
+    : path_(path), alignment_(alignment == 0 ? 1 : alignment), zeros_(std::min<size_t>(alignment_, 1 << 21), 0) {
+        ::unlink(path.c_str());  // may be a link into a blob store
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) throw std::runtime_error("Failed to open file: " + path);
+    }
+
+    ~WeightsSink() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    // Pad to the alignment and return where the next tensor starts.
+    uint64_t begin_tensor() {
+        uint64_t offset = (end_ + alignment_ - 1) / alignment_ * alignment_;
+        while (end_ < offset) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(offset - end_, zeros_.size()));
+            write(zeros_.data(), n);
+            padding_ += n;
+        }
+        return offset;
+    }
+
+    void write(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd_, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw std::runtime_error("Failed to write " + path_ + ": " + std::strerror(errno));
+            data += n;
+            size -= static_cast<size_t>(n);
+            end_ += static_cast<uint64_t>(n);
+        }
+    }
+
+    void close() {
+        int fd = fd_;
+        fd_ = -1;
+        if (::close(fd) != 0) throw std::runtime_error("Failed to write " + path_ + ": " + std::strerror(errno));
+    }
+
+    uint64_t size() const { return end_; }
+    uint64_t padding() const { return padding_; }
+
+private:
+    std::string path_;
+    size_t alignment_;
+    std::vector<char> zeros_;
+    int fd_ = -1;
+    uint64_t end_ = 0;
+    uint64_t padding_ = 0;
+};
+
+struct TensorSplitter {
+    const StreamSplitOptions& options;
+    const std::string& location;
+    WeightsSink& sink;
+    std::vector<char> chunk;
+    StreamSplitStats& stats;
+
+    // Copy `size` bytes from `file` to the weights file through `chunk`,
+    // checksumming them on the way.
+    bool copy_raw(FileInputStream& file, uint64_t size, uint32_t& crc) {
+        size_t filled = 0;
+        while (size > 0) {
+            const void* data = nullptr;
+            int available = 0;
+            if (!file.Next(&data, &available)) return false;
+            size_t n = static_cast<size_t>(std::min<uint64_t>(static_cast<uint64_t>(available), size));
+            const char* bytes = static_cast<const char*>(data);
+            for (size_t done = 0; done < n;) {
+                size_t count = std::min(n - done, chunk.size() - filled);
+                std::memcpy(chunk.data() + filled, bytes + done, count);
+                filled += count;
+                done += count;
+                if (filled == chunk.size()) {
+                    crc = crc32c(chunk.data(), filled, crc);
+                    sink.write(chunk.data(), filled);
+                    filled = 0;
+                }
+            }
+            if (static_cast<size_t>(available) > n) file.BackUp(available - static_cast<int>(n));
+            size -= n;
+        }
+        crc = crc32c(chunk.data(), filled, crc);
+        sink.write(chunk.data(), filled);
+        return true;
+    }
+
+    // Copy one TensorProto of `length` bytes from `file` to `out`, moving a
+    // large raw_data to the weights file on the way. Like the graph, the
+    // tensor is read one field at a time, and a raw_data going external is
+    // copied straight from `file`, so neither is held to the 2 GiB limit of a
+    // CodedInputStream.
+    bool split(FileInputStream& file, uint64_t length, std::string& out) {
+        std::string header;  // every field but an externalized raw_data
+        bool external = false;
+        uint64_t offset = 0, size = 0;
+        uint32_t crc = 0;
+        uint64_t consumed = 0;
+        while (consumed < length) {
+            uint64_t n = 0;
+            {
+                CodedInputStream in(&file);
+                uint32_t tag = in.ReadTag();
+                if (tag == 0) return false;
+                bool raw_data = WireFormatLite::GetTagFieldNumber(tag) == onnx::TensorProto::kRawDataFieldNumber
+                    && is_length_delimited(tag);
+                if (!raw_data) {
+                    if (!copy_field(in, tag, header)) return false;
+                    consumed += static_cast<uint64_t>(in.CurrentPosition());
+                    continue;
+                }
+                if (!in.ReadVarint64(&n)) return false;
+                if (n < options.size_threshold) {
+                    std::string value;
+                    if (!in.ReadString(&value, static_cast<int>(n))) return false;
+                    append_field(header, onnx::TensorProto::kRawDataFieldNumber, value);
+                    consumed += static_cast<uint64_t>(in.CurrentPosition());
+                    continue;
+                }
+                consumed += static_cast<uint64_t>(in.CurrentPosition());
+            }  // hands the unread buffer back to `file`
+
+            offset = sink.begin_tensor();
+            size = n;
+            external = true;
+            if (!copy_raw(file, n, crc)) return false;
+            consumed += n;
+        }
+        if (consumed != length) return false;
+
+        if (!external) {
+            stats.inline_tensors++;
+            append_field(out, onnx::GraphProto::kInitializerFieldNumber, header);
+            return true;
+        }
+
+        // The rest of the tensor is small: rebuild it as a message
+        onnx::TensorProto tensor;
+        if (!tensor.ParseFromString(header)) return false;
+        tensor.set_data_location(onnx::TensorProto_DataLocation_EXTERNAL);
+        auto add_entry = [&](const std::string& key, const std::string& value) {
+            auto* entry = tensor.add_external_data();
+            entry->set_key(key);
+            entry->set_value(value);
+        };
+        add_entry("location", location);
+        add_entry("offset", std::to_string(offset));
+        add_entry("length", std::to_string(size));
+        add_entry("checksum", format_crc32c_checksum(crc));
+        append_field(out, onnx::GraphProto::kInitializerFieldNumber, tensor.SerializeAsString());
+        if (options.index) options.index->add(tensor);
+        stats.tensors++;
+        return true;
+    }
+};
+
+} // namespace
+
+void stream_split(const std::string& model_path, const std::string& graph_path,
+                  const std::string& weights_path, const std::string& location,
+                  const StreamSplitOptions& options, StreamSplitStats* stats) {
+    auto begin = std::chrono::high_resolution_clock::now();
+    StreamSplitStats local;
+    StreamSplitStats& st = stats ? *stats : local;
+    st = StreamSplitStats();
+
+    int fd = ::open(model_path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Failed to open " + model_path);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    FileInputStream file(fd, 1 << 20);
+    file.SetCloseOnDelete(true);
+
+    WeightsSink sink(weights_path, options.alignment);
+    TensorSplitter splitter{options, location, sink, std::vector<char>(options.chunk_size), st};
+    auto fail = [&](const char* what) {
+        throw std::runtime_error(std::string("Malformed model ") + model_path + " (" + what + ") at byte "
+                                 + std::to_string(file.ByteCount()));
+    };
+
+    // Top-level fields are copied as they are, except the graph, which is
+    // walked field by field. Each field gets a fresh CodedInputStream: its
+    // byte counters are ints, so one stream cannot cover the whole file.
+    std::string model;
+    while (true) {
+        std::unique_ptr<CodedInputStream> in(new CodedInputStream(&file));
+        uint32_t tag = in->ReadTag();
+        if (tag == 0) break;
+        if (WireFormatLite::GetTagFieldNumber(tag) != onnx::ModelProto::kGraphFieldNumber || !is_length_delimited(tag)) {
+            if (!copy_field(*in, tag, model)) fail("model field");
+            continue;
+        }
+
+        uint64_t graph_length = 0;
+        if (!in->ReadVarint64(&graph_length)) fail("graph length");
+        in.reset();  // hands the unread buffer back to `file`
+
+        std::string graph;
+        uint64_t consumed = 0;
+        while (consumed < graph_length) {
+            uint64_t initializer_length = 0;
+            bool initializer = false;
+            {
+                CodedInputStream field(&file);
+                uint32_t graph_tag = field.ReadTag();
+                if (graph_tag == 0) fail("truncated graph");
+                if (WireFormatLite::GetTagFieldNumber(graph_tag) == onnx::GraphProto::kInitializerFieldNumber
+                    && is_length_delimited(graph_tag)) {
+                    if (!field.ReadVarint64(&initializer_length)) fail("initializer length");
+                    initializer = true;
+                } else if (!copy_field(field, graph_tag, graph)) {
+                    fail("graph field");
+                }
+                consumed += static_cast<uint64_t>(field.CurrentPosition());
+            }
+            if (initializer) {
+                if (!splitter.split(file, initializer_length, graph)) fail("initializer");
+                consumed += initializer_length;
+            }
+        }
+        if (consumed != graph_length) fail("graph length mismatch");
+        append_field(model, onnx::ModelProto::kGraphFieldNumber, graph);
+    }
+    st.model_bytes = static_cast<uint64_t>(file.ByteCount());
+
+    // Record the alignment so loaders can rely on it
+    onnx::StringStringEntryProto alignment;
+    alignment.set_key(kExternalDataAlignmentKey);
+    alignment.set_value(std::to_string(options.alignment));
+    append_field(model, onnx::ModelProto::kMetadataPropsFieldNumber, alignment.SerializeAsString());
+
+    sink.close();
+    std::ofstream out(graph_path, std::ios::binary | std::ios::trunc);
+    out.write(model.data(), static_cast<std::streamsize>(model.size()));
+    out.close();
+    if (!out) throw std::runtime_error("Failed to write " + graph_path);
+
+    st.bytes = sink.size();
+    st.padding = sink.padding();
+    st.graph_bytes = model.size();
+    st.elapsed_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - begin).count();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class TensorIndexWriter;
+
+// Split a model without parsing it as a whole.
+//
+// ParseFromIstream refuses models over 2 GiB and holds every weight in
+// memory. The streaming splitter walks the ModelProto wire format instead,
+// one top-level field, graph field and initializer field at a time, each
+// through a fresh CodedInputStream over the same file so that no stream ever
+// passes the 2 GiB limit. Every initializer's raw_data of at least
+// `size_threshold` bytes is copied in fixed-size chunks straight from the
+// file to the weights file, checksummed on the way, so a single tensor may
+// itself be over 2 GiB. Only the remaining metadata is kept in memory and
+// rewritten to graph.onnx. Memory use does not grow with the weights.
+//
+// Tensors inside nodes, sparse initializers and subgraphs, and typed-field
+// tensors, are copied to graph.onnx as they are; each such field must stay
+// under 2 GiB.
+
+struct StreamSplitOptions {
+    size_t size_threshold = 1024;  // smaller raw_data stays in the graph
+    size_t alignment = 4096;       // every external tensor starts on a multiple of this
+    size_t chunk_size = 4 << 20;   // bytes copied per read
+    TensorIndexWriter* index = nullptr;  // records each externalized tensor when set
+};
+
+struct StreamSplitStats {
+    size_t tensors = 0;          // initializers written to the weights file
+    size_t inline_tensors = 0;   // initializers kept in the graph
+    uint64_t bytes = 0;          // weights file size, padding included
+    uint64_t padding = 0;
+    uint64_t model_bytes = 0;    // size of the input model
+    uint64_t graph_bytes = 0;    // size of the rewritten graph
+    double elapsed_ms = 0;
+};
+
+// Read `model_path`, write its weights to `weights_path` (recorded in the
+// graph as `location`) and the rest to `graph_path`. Throws
+// std::runtime_error on failure.
+void stream_split(const std::string& model_path, const std::string& graph_path,
+                  const std::string& weights_path, const std::string& location,
+                  const StreamSplitOptions& options, StreamSplitStats* stats = nullptr);
@@ -0,0 +1,170 @@
+#include "tensor_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+#include "onnx.pb.h"
+#include "external_data.h"
+#include "xxhash64.h"
+
+uint32_t TensorIndexWriter::add_string(const std::string& value) {
+    if (strings_.size() + value.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Tensor index string table over 4 GiB");
+    }
+    uint32_t offset = static_cast<uint32_t>(strings_.size());
+    strings_ += value;
+    return offset;
+}
+
+void TensorIndexWriter::add(const onnx::TensorProto& tensor) {
+    if (tensor.data_location() != onnx::TensorProto_DataLocation_EXTERNAL) return;
+
+    ExternalDataInfo info = get_external_data_info(tensor);
+    TensorIndexEntry entry = {};
+    entry.name_hash = xxh64(tensor.name().data(), tensor.name().size());
+    entry.name_offset = add_string(tensor.name());
+    entry.name_length = static_cast<uint32_t>(tensor.name().size());
+    entry.data_type = tensor.data_type();
+    entry.rank = static_cast<uint32_t>(tensor.dims_size());
+    entry.dims_index = static_cast<uint32_t>(dims_.size());
+    dims_.insert(dims_.end(), tensor.dims().begin(), tensor.dims().end());
+
+    auto it = std::find(location_names_.begin(), location_names_.end(), info.location);
+    if (it == location_names_.end()) {
+        if (location_names_.size() > std::numeric_limits<uint16_t>::max()) {
+            throw std::runtime_error("Too many external data files for the tensor index");
+        }
+        locations_.push_back({add_string(info.location), static_cast<uint32_t>(info.location.size())});
+        it = location_names_.insert(location_names_.end(), info.location);
+    }
+    entry.location = static_cast<uint16_t>(it - location_names_.begin());
+
+    entry.offset = info.offset;
+    entry.length = info.length;
+    entry.raw_length = decoded_length(info);
+    if (parse_crc32c_checksum(info.checksum, &entry.crc32c)) entry.flags |= kTensorIndexChecksum;
+    if (!info.compression.empty()) entry.flags |= kTensorIndexCompressed;
+    entries_.push_back(entry);
+}
+
+void TensorIndexWriter::write(const std::string& path, const std::string& graph_path) const {
+    MappedFile graph;
+    if (!graph.open(graph_path)) throw std::runtime_error("Failed to map " + graph_path);
+
+    uint32_t slot_count = 2;
+    while (slot_count < 2 * entries_.size()) slot_count *= 2;
+    std::vector<uint32_t> slots(slot_count, 0);
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        uint32_t slot = static_cast<uint32_t>(entries_[i].name_hash) & (slot_count - 1);
+        while (slots[slot] != 0) slot = (slot + 1) & (slot_count - 1);
+        slots[slot] = static_cast<uint32_t>(i + 1);
+    }
+
+    TensorIndexHeader header = {};
+    std::memcpy(header.magic, kTensorIndexMagic, sizeof(header.magic));
+    header.version = kTensorIndexVersion;
+    header.entry_size = sizeof(TensorIndexEntry);
+    header.count = static_cast<uint32_t>(entries_.size());
+    header.slot_count = slot_count;
+    header.location_count = static_cast<uint32_t>(locations_.size());
+    header.graph_size = graph.size();
+    header.graph_hash = xxh64(graph.data(), graph.size());
+    header.dims_count = dims_.size();
+    header.strings_size = strings_.size();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    auto write = [&](const void* data, size_t size) {
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    };
+    write(&header, sizeof(header));
+    write(entries_.data(), entries_.size() * sizeof(TensorIndexEntry));
+    write(slots.data(), slots.size() * sizeof(uint32_t));
+    write(locations_.data(), locations_.size() * sizeof(TensorIndexLocation));
+    write(dims_.data(), dims_.size() * sizeof(int64_t));
+    write(strings_.data(), strings_.size());
+    out.close();
+    if (!out) throw std::runtime_error("Failed to write " + path);
+}
+
+bool TensorIndex::open(const std::string& path) {
+    close();
+    if (!file_.open(path)) return false;
+
+    auto malformed = [&](const char* what) {
+        std::cerr << "Ignoring malformed tensor index " << path << " (" << what << ")\n";
+        close();
+        return false;
+    };
+    if (file_.size() < sizeof(TensorIndexHeader)) return malformed("truncated header");
+    const auto* header = reinterpret_cast<const TensorIndexHeader*>(file_.data());
+    if (std::memcmp(header->magic, kTensorIndexMagic, sizeof(header->magic)) != 0) return malformed("bad magic");
+    if (header->version != kTensorIndexVersion || header->entry_size != sizeof(TensorIndexEntry)) {
+        return malformed("unsupported version");
+    }
+    if (header->slot_count < 2 || header->slot_count < 2 * uint64_t(header->count)
+        || (header->slot_count & (header->slot_count - 1)) != 0) {
+        return malformed("bad slot table");
+    }
+
+    // Every section is a multiple of 8 bytes but the last, so the dims stay
+    // aligned in the mapping
+    uint64_t entries = sizeof(TensorIndexHeader);
+    uint64_t slots = entries + uint64_t(header->count) * sizeof(TensorIndexEntry);
+    uint64_t locations = slots + uint64_t(header->slot_count) * sizeof(uint32_t);
+    uint64_t dims = locations + uint64_t(header->location_count) * sizeof(TensorIndexLocation);
+    uint64_t strings = dims + header->dims_count * sizeof(int64_t);
+    if (header->dims_count > file_.size() || strings + header->strings_size != file_.size()) {
+        return malformed("bad section sizes");
+    }
+
+    entries_ = reinterpret_cast<const TensorIndexEntry*>(file_.data() + entries);
+    slots_ = reinterpret_cast<const uint32_t*>(file_.data() + slots);
+    locations_ = reinterpret_cast<const TensorIndexLocation*>(file_.data() + locations);
+    dims_ = reinterpret_cast<const int64_t*>(file_.data() + dims);
+    strings_ = file_.data() + strings;
+
+    // Check every reference once so that the accessors need not
+    for (uint32_t i = 0; i < header->location_count; ++i) {
+        if (uint64_t(locations_[i].offset) + locations_[i].length > header->strings_size) {
+            return malformed("location out of range");
+        }
+    }
+    for (uint32_t i = 0; i < header->count; ++i) {
+        const TensorIndexEntry& entry = entries_[i];
+        if (uint64_t(entry.name_offset) + entry.name_length > header->strings_size
+            || uint64_t(entry.dims_index) + entry.rank > header->dims_count
+            || entry.location >= header->location_count) {
+            return malformed("entry out of range");
+        }
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < header->slot_count; ++i) {
+        if (slots_[i] > header->count) return malformed("slot out of range");
+        used += slots_[i] != 0;
+    }
+    if (used != header->count) return malformed("bad slot table");
+    header_ = header;
+    return true;
+}
+
+bool TensorIndex::describes(const std::string& graph_path) const {
+    MappedFile graph;
+    return header_ && graph.open(graph_path) && graph.size() == header_->graph_size
+        && xxh64(graph.data(), graph.size()) == header_->graph_hash;
+}
+
+const TensorIndexEntry* TensorIndex::find(std::string_view name) const {
+    if (!header_) return nullptr;
+    uint64_t hash = xxh64(name.data(), name.size());
+    uint32_t mask = header_->slot_count - 1;
+    // At least half the slots are empty, so the probe always ends
+    for (uint32_t slot = static_cast<uint32_t>(hash) & mask; slots_[slot] != 0; slot = (slot + 1) & mask) {
+        const TensorIndexEntry& entry = entries_[slots_[slot] - 1];
+        if (entry.name_hash == hash && this->name(entry) == name) return &entry;
+    }
+    return nullptr;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "mapped_file.h"
+
+namespace onnx {
+class TensorProto;
+}
+
+// Binary sidecar listing where every external tensor lives.
+//
+// Finding a tensor in graph.onnx means parsing the whole graph, then scanning
+// each tensor's external_data key/value strings. split also writes
+// tensors.idx: fixed-width records a loader maps and searches in place, no
+// parsing and no allocation. The file is little-endian and laid out as
+//
+//   TensorIndexHeader
+//   TensorIndexEntry[count]          in the order the graph lists the tensors
+//   uint32_t slots[slot_count]       open-addressing table, entry index + 1
+//   TensorIndexLocation[location_count]
+//   int64_t dims[dims_count]
+//   char strings[strings_size]       names and locations, not terminated
+//
+// The header records the size and hash of graph.onnx, so a loader can tell
+// when the index was written for another graph.
+//
+// Each tensor's slot search starts at name_hash & (slot_count - 1). The table
+// is never more than half full. If several tensors share a name, find()
+// returns the first. Unnamed ones, such as sparse indices, are only reached by
+// walking the entries.
+//
+// Block-compressed tensors are flagged, but their block list only lives in
+// graph.onnx.
+
+constexpr char kTensorIndexMagic[8] = {'O', 'N', 'N', 'X', 'I', 'D', 'X', '1'};
+constexpr uint32_t kTensorIndexVersion = 1;
+
+// Default file name, next to graph.onnx
+constexpr const char* kTensorIndexFile = "tensors.idx";
+
+enum TensorIndexFlags : uint16_t {
+    kTensorIndexChecksum = 1,    // crc32c is set
+    kTensorIndexCompressed = 2,  // length is the stored size, raw_length the decoded one
+};
+
+struct TensorIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t count;
+    uint32_t slot_count;      // a power of two
+    uint32_t location_count;
+    uint32_t reserved;
+    uint64_t graph_size;      // size and XXH64 of the graph file the index
+    uint64_t graph_hash;      // was written for
+    uint64_t dims_count;
+    uint64_t strings_size;
+};
+
+struct TensorIndexEntry {
+    uint64_t name_hash;       // XXH64 of the name
+    uint32_t name_offset;     // into strings
+    uint32_t name_length;
+    int32_t data_type;        // onnx::TensorProto_DataType
+    uint32_t rank;
+    uint32_t dims_index;      // first of `rank` values in dims
+    uint16_t location;        // into the location table
+    uint16_t flags;
+    uint64_t offset;
+    uint64_t length;          // bytes in the file
+    uint64_t raw_length;      // bytes once decompressed
+    uint32_t crc32c;
+    uint32_t reserved;
+};
+
+struct TensorIndexLocation {
+    uint32_t offset;          // into strings
+    uint32_t length;
+};
+
+static_assert(sizeof(TensorIndexHeader) == 64, "TensorIndexHeader is 64 bytes on disk");
+static_assert(sizeof(TensorIndexEntry) == 64, "TensorIndexEntry is 64 bytes on disk");
+static_assert(sizeof(TensorIndexLocation) == 8, "TensorIndexLocation is 8 bytes on disk");
+
+// Collects the external tensors of a model as split writes them.
+class TensorIndexWriter {
+public:
+    // Record `tensor` if its data is external.
+    void add(const onnx::TensorProto& tensor);
+
+    size_t size() const { return entries_.size(); }
+
+    // Write the index for the graph file at `graph_path`, already written.
+    // Throws std::runtime_error on failure.
+    void write(const std::string& path, const std::string& graph_path) const;
+
+private:
+    uint32_t add_string(const std::string& value);
+
+    std::vector<TensorIndexEntry> entries_;
+    std::vector<TensorIndexLocation> locations_;
+    std::vector<std::string> location_names_;
+    std::vector<int64_t> dims_;
+    std::string strings_;
+};
+
+// A mapped tensors.idx.
+class TensorIndex {
+public:
+    // Map and validate `path`. Returns false if it is missing; prints the
+    // reason if it is malformed.
+    bool open(const std::string& path);
+    void close() {
+        file_.close();
+        header_ = nullptr;
+    }
+
+    size_t size() const { return header_ ? header_->count : 0; }
+
+    // True if the index was written for the graph file at `graph_path` as
+    // it is now.
+    bool describes(const std::string& graph_path) const;
+
+    const TensorIndexEntry& entry(size_t i) const { return entries_[i]; }
+    const TensorIndexEntry* find(std::string_view name) const;
+
+    std::string_view name(const TensorIndexEntry& entry) const {
+        return {strings_ + entry.name_offset, entry.name_length};
+    }
+    std::string_view location(const TensorIndexEntry& entry) const {
+        const TensorIndexLocation& location = locations_[entry.location];
+        return {strings_ + location.offset, location.length};
+    }
+    const int64_t* dims(const TensorIndexEntry& entry) const { return dims_ + entry.dims_index; }
+
+private:
+    MappedFile file_;
+    const TensorIndexHeader* header_ = nullptr;
+    const TensorIndexEntry* entries_ = nullptr;
+    const uint32_t* slots_ = nullptr;
+    const TensorIndexLocation* locations_ = nullptr;
+    const int64_t* dims_ = nullptr;
+    const char* strings_ = nullptr;
+};
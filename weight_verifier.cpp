@@ -0,0 +1,159 @@
+#include "weight_verifier.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <set>
+#include <thread>
+#include <tuple>
+
+#include "crc32c.h"
+#include "external_data.h"
+#include "mapped_file.h"
+#include "tensor_index.h"
+
+namespace {
+
+// Large enough to amortize the combine step, small enough to spread a
+// single large tensor over every thread.
+constexpr uint64_t kChunkSize = 4 << 20;
+
+struct Chunk {
+    size_t target = 0;
+    const char* data = nullptr;
+    uint64_t length = 0;
+    uint32_t crc = 0;
+};
+
+} // namespace
+
+std::vector<ChecksumTarget> collect_checksum_targets(const onnx::ModelProto& model, size_t* unchecked) {
+    std::vector<ChecksumTarget> targets;
+    std::set<std::tuple<std::string, uint64_t, uint64_t>> seen;  // deduplicated tensors share a range
+    size_t missing = 0;
+    for (const auto* tensor : model_tensors(model)) {
+        if (tensor->data_location() != onnx::TensorProto_DataLocation_EXTERNAL) continue;
+
+        ExternalDataInfo info = get_external_data_info(*tensor);
+        ChecksumTarget target;
+        if (!parse_crc32c_checksum(info.checksum, &target.crc32c)) {
+            missing++;
+            continue;
+        }
+        if (!seen.emplace(info.location, info.offset, info.length).second) continue;
+        target.name = tensor->name();
+        target.location = info.location;
+        target.offset = info.offset;
+        target.length = info.length;
+        targets.push_back(std::move(target));
+    }
+    if (unchecked) *unchecked = missing;
+    return targets;
+}
+
+std::vector<ChecksumTarget> collect_checksum_targets(const TensorIndex& index, size_t* unchecked) {
+    std::vector<ChecksumTarget> targets;
+    std::set<std::tuple<std::string_view, uint64_t, uint64_t>> seen;
+    size_t missing = 0;
+    for (size_t i = 0; i < index.size(); ++i) {
+        const TensorIndexEntry& entry = index.entry(i);
+        if (!(entry.flags & kTensorIndexChecksum)) {
+            missing++;
+            continue;
+        }
+        if (!seen.emplace(index.location(entry), entry.offset, entry.length).second) continue;
+        ChecksumTarget target;
+        target.name = std::string(index.name(entry));
+        target.location = std::string(index.location(entry));
+        target.offset = entry.offset;
+        target.length = entry.length;
+        target.crc32c = entry.crc32c;
+        targets.push_back(std::move(target));
+    }
+    if (unchecked) *unchecked = missing;
+    return targets;
+}
+
+bool verify_checksums(const std::string& base_dir,
+                      const std::vector<ChecksumTarget>& targets,
+                      unsigned threads,
+                      VerifyStats* stats) {
+    auto begin = std::chrono::high_resolution_clock::now();
+    VerifyStats local;
+    VerifyStats& st = stats ? *stats : local;
+    st = VerifyStats();
+    st.tensors = targets.size();
+    st.implementation = crc32c_implementation();
+
+    // 1) Map every file and cut the tensors into chunks
+    std::map<std::string, MappedFile> files;
+    std::vector<Chunk> chunks;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        const ChecksumTarget& target = targets[i];
+        auto it = files.find(target.location);
+        if (it == files.end()) {
+            MappedFile file;
+            if (!file.open(base_dir + "/" + target.location)) {
+                std::cerr << "Failed to map external data file: " << target.location << "\n";
+                return false;
+            }
+            it = files.emplace(target.location, std::move(file)).first;
+        }
+        if (target.offset + target.length > it->second.size()) {
+            std::cerr << "External data file " << target.location << " is " << it->second.size()
+                      << " bytes, but tensor " << target.name << " ends at byte "
+                      << target.offset + target.length << "\n";
+            return false;
+        }
+
+        const char* data = it->second.data() + target.offset;
+        uint64_t done = 0;
+        do {
+            uint64_t length = std::min(kChunkSize, target.length - done);
+            chunks.push_back({i, data + done, length, 0});
+            done += length;
+        } while (done < target.length);
+        st.bytes += target.length;
+    }
+
+    // 2) Checksum the chunks on a pool of threads
+    if (threads == 0) threads = std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+    threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, chunks.size())));
+    st.threads = threads;
+
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < chunks.size(); i = next++) {
+            chunks[i].crc = crc32c(chunks[i].data, chunks[i].length);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool) thread.join();
+
+    // 3) Fold the chunks of each tensor back together, in order
+    size_t c = 0;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        uint32_t crc = chunks[c].crc;
+        for (++c; c < chunks.size() && chunks[c].target == i; ++c) {
+            crc = crc32c_combine(crc, chunks[c].crc, chunks[c].length);
+        }
+        if (crc != targets[i].crc32c) {
+            char expected[9], actual[9];
+            snprintf(expected, sizeof(expected), "%08x", targets[i].crc32c);
+            snprintf(actual, sizeof(actual), "%08x", crc);
+            std::cerr << "Checksum mismatch for tensor " << targets[i].name << " in "
+                      << targets[i].location << ": expected crc32c " << expected
+                      << ", got " << actual << "\n";
+            st.mismatched++;
+        }
+    }
+
+    st.elapsed_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - begin).count();
+    return st.mismatched == 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "onnx.pb.h"
+
+class TensorIndex;
+
+// Integrity check for external tensor data.
+//
+// split stores a CRC-32C of every tensor it externalizes in the tensor's
+// "checksum" entry. The verifier maps the weight files and recomputes those
+// checksums, cutting large tensors into chunks so that a single big
+// embedding does not end up on one thread, and combining the chunk CRCs
+// afterwards.
+
+struct ChecksumTarget {
+    std::string name;
+    std::string location;  // file name relative to base_dir
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint32_t crc32c = 0;   // expected value
+};
+
+struct VerifyStats {
+    size_t tensors = 0;
+    size_t mismatched = 0;
+    uint64_t bytes = 0;
+    unsigned threads = 0;
+    double elapsed_ms = 0;
+    const char* implementation = "software";  // crc32c instructions used
+};
+
+// Checksummed external initializers of `model`. Tensors written by an older
+// split have no checksum and are counted in `unchecked`.
+std::vector<ChecksumTarget> collect_checksum_targets(const onnx::ModelProto& model,
+                                                     size_t* unchecked = nullptr);
+
+// The same, read from split's tensor index without walking the graph.
+std::vector<ChecksumTarget> collect_checksum_targets(const TensorIndex& index, size_t* unchecked = nullptr);
+
+// Recompute every target's checksum on `threads` threads (0: one per core,
+// capped at 8). Returns false (after printing the reason) if a file is
+// missing, too short, or any tensor does not match.
+bool verify_checksums(const std::string& base_dir,
+                      const std::vector<ChecksumTarget>& targets,
+                      unsigned threads,
+                      VerifyStats* stats = nullptr);
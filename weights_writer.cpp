@@ -0,0 +1,243 @@
+#include "weights_writer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "external_data.h"
+#include "xxhash64.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace {
+
+// A run of consecutive pieces written with one pwritev(), padding included.
+struct Batch {
+    size_t first = 0;
+    size_t count = 0;
+    uint64_t offset = 0;
+    std::vector<iovec> iov;
+};
+
+// Write a whole batch with pwritev(), resuming after short writes.
+bool write_batch(int fd, Batch& batch) {
+    size_t first = 0;
+    uint64_t offset = batch.offset;
+    while (first < batch.iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(batch.iov.size() - first, IOV_MAX));
+        ssize_t n = pwritev(fd, batch.iov.data() + first, count, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+
+        offset += n;
+        size_t left = static_cast<size_t>(n);
+        while (left > 0) {
+            if (left >= batch.iov[first].iov_len) {
+                left -= batch.iov[first].iov_len;
+                first++;
+            } else {
+                batch.iov[first].iov_base = static_cast<char*>(batch.iov[first].iov_base) + left;
+                batch.iov[first].iov_len -= left;
+                left = 0;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+WeightsWriter::WeightsWriter(std::string path, std::string location, WriterOptions options)
+: path_(std::move(path)), location_(std::move(location)), options_(options) {
+    if (options_.alignment == 0) options_.alignment = 1;
+    struct stat st;
+    if (options_.append && ::stat(path_.c_str(), &st) == 0) start_ = end_ = st.st_size;
+}
+
+size_t WeightsWriter::find(const std::string& payload, uint64_t hash) const {
+    bool have_crc = false;
+    uint32_t crc = 0;
+    auto range = by_hash_.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        const Content& content = contents_[it->second];
+        if (content.blob.length != payload.size()) continue;
+        if (content.piece != kNone) {
+            if (std::memcmp(pieces_[content.piece].payload.data(), payload.data(), payload.size()) == 0) {
+                return it->second;
+            }
+            continue;
+        }
+        // Already in the file: the CRC backs up the hash
+        if (!have_crc) {
+            crc = crc32c(payload.data(), payload.size());
+            have_crc = true;
+        }
+        if (crc == content.blob.crc32c) return it->second;
+    }
+    return kNone;
+}
+
+void WeightsWriter::reuse(const StoredBlob& blob) {
+    by_hash_.emplace(blob.hash, contents_.size());
+    contents_.push_back({blob, kNone});
+}
+
+void WeightsWriter::add(onnx::TensorProto& tensor) {
+    const std::string& raw = tensor.raw_data();
+    add(tensor, options_.dedup ? xxh64(raw.data(), raw.size()) : 0);
+}
+
+void WeightsWriter::add(onnx::TensorProto& tensor, uint64_t hash) {
+    std::string payload;
+    payload.swap(*tensor.mutable_raw_data());
+    tensor.clear_raw_data();
+
+    size_t content = options_.dedup ? find(payload, hash) : kNone;
+    if (content != kNone) {
+        duplicates_++;
+        saved_ += payload.size();
+    } else {
+        uint64_t offset = (end_ + options_.alignment - 1) / options_.alignment * options_.alignment;
+        padding_ += offset - end_;
+        end_ = offset + payload.size();
+
+        content = contents_.size();
+        contents_.push_back({{hash, payload.size(), offset, 0}, pieces_.size()});
+        if (options_.dedup) by_hash_.emplace(hash, content);
+        pieces_.push_back({std::move(payload), offset, content});
+    }
+    tensors_.emplace_back(&tensor, content);
+    const StoredBlob& blob = contents_[content].blob;
+
+    // set this tensor to have external data, loaded separately
+    tensor.set_data_location(onnx::TensorProto_DataLocation_EXTERNAL);
+
+    // and say where this data is
+    auto add_entry = [&](const std::string& key, const std::string& value) {
+        auto* entry = tensor.add_external_data();
+        entry->set_key(key);
+        entry->set_value(value);
+    };
+
+    add_entry("location", location_);
+    add_entry("offset", std::to_string(blob.offset));
+    add_entry("length", std::to_string(blob.length));
+}
+
+void WeightsWriter::finish(WriterStats* stats) {
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    // Unlink before truncating: the old file may be a link into a blob
+    // store, or still mapped by a running process.
+    if (!options_.append) ::unlink(path_.c_str());
+    int fd = ::open(path_.c_str(), O_WRONLY | O_CREAT | (options_.append ? 0 : O_TRUNC), 0644);
+    if (fd < 0) throw std::runtime_error("Failed to open file: " + path_);
+
+    // 1) Cut the layout into batches, padding included
+    std::vector<char> zeros(std::min<size_t>(options_.alignment, 1 << 21), 0);
+    std::vector<Batch> batches;
+    uint64_t position = start_;
+    for (size_t i = 0; i < pieces_.size(); ++i) {
+        const Piece& piece = pieces_[i];
+        if (batches.empty()
+            || position - batches.back().offset + piece.payload.size() > options_.max_batch
+            || batches.back().iov.size() + 2 > IOV_MAX) {
+            batches.push_back({i, 0, position, {}});
+        }
+        Batch& batch = batches.back();
+        for (uint64_t gap = piece.offset - position; gap > 0; ) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(gap, zeros.size()));
+            batch.iov.push_back({zeros.data(), n});
+            gap -= n;
+        }
+        if (!piece.payload.empty()) {
+            batch.iov.push_back({const_cast<char*>(piece.payload.data()), piece.payload.size()});
+        }
+        batch.count++;
+        position = piece.offset + piece.payload.size();
+    }
+
+    // 2) Checksum and write the batches on a pool of threads
+    unsigned threads = options_.threads;
+    if (threads == 0) threads = std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+    threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, batches.size())));
+
+    std::vector<uint32_t> checksums(pieces_.size());
+    std::atomic<size_t> next{0};
+    std::atomic<bool> ok{true};
+    std::atomic<int> error{0};
+    auto worker = [&]() {
+        for (size_t b = next++; b < batches.size() && ok; b = next++) {
+            Batch& batch = batches[b];
+            for (size_t i = batch.first; i < batch.first + batch.count; ++i) {
+                checksums[i] = crc32c(pieces_[i].payload.data(), pieces_[i].payload.size());
+            }
+            if (!write_batch(fd, batch)) {
+                error = errno;
+                ok = false;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool) thread.join();
+
+    if (::close(fd) != 0 && ok) {
+        error = errno;
+        ok = false;
+    }
+    if (!ok) {
+        throw std::runtime_error("Failed to write " + path_ + ": " + std::strerror(error));
+    }
+
+    // 3) Record the checksums and drop the payloads
+    for (size_t i = 0; i < pieces_.size(); ++i) {
+        Content& content = contents_[pieces_[i].content];
+        content.blob.crc32c = checksums[i];
+        content.piece = kNone;
+    }
+    for (const auto& [tensor, content] : tensors_) {
+        auto* entry = tensor->add_external_data();
+        entry->set_key("checksum");
+        entry->set_value(format_crc32c_checksum(contents_[content].blob.crc32c));
+    }
+
+    if (stats) {
+        stats->tensors = tensors_.size();
+        stats->writes = batches.size();
+        stats->bytes = end_ - start_;
+        stats->padding = padding_;
+        stats->duplicates = duplicates_;
+        stats->saved = saved_;
+        stats->threads = threads;
+        stats->elapsed_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - begin).count();
+    }
+    pieces_.clear();
+    tensors_.clear();
+    start_ = end_;
+    padding_ = 0;
+    duplicates_ = 0;
+    saved_ = 0;
+}
+
+std::vector<StoredBlob> WeightsWriter::blobs() const {
+    std::vector<StoredBlob> blobs;
+    blobs.reserve(contents_.size());
+    for (const auto& content : contents_) blobs.push_back(content.blob);
+    return blobs;
+}
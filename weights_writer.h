@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "onnx.pb.h"
+
+// Writer for an external data file.
+//
+// Tensors handed to add() give up their raw_data and are pointed at their
+// place in the file straight away; nothing is written yet. finish() then
+// lays the payloads out back to back (each on an `alignment` boundary),
+// gathers neighbours into large pwritev() calls on a single descriptor, and
+// spreads those writes, together with the per-tensor checksums, over a pool
+// of threads.
+//
+// Payloads are fingerprinted with XXH64 as they are added: a tensor whose
+// bytes are already queued (tied embeddings, repeated constants) is pointed
+// at the first copy instead of being written again. In append mode the file
+// keeps its contents, and blobs known to be in it can be registered with
+// reuse(), so that a blob store shared by several models grows only by what
+// is new.
+
+struct WriterOptions {
+    size_t alignment = 4096;       // every tensor starts on a multiple of this
+    unsigned threads = 0;          // 0: one per core, capped at 8
+    size_t max_batch = 16 << 20;   // largest single write, unless one tensor is larger
+    bool dedup = true;             // write identical payloads once
+    bool append = false;           // keep the file's contents and write after them
+};
+
+// A unique payload in the file.
+struct StoredBlob {
+    uint64_t hash = 0;    // XXH64 of the payload
+    uint64_t length = 0;
+    uint64_t offset = 0;
+    uint32_t crc32c = 0;
+};
+
+struct WriterStats {
+    size_t tensors = 0;
+    size_t writes = 0;  // pwritev() batches
+    uint64_t bytes = 0;
+    uint64_t padding = 0;
+    size_t duplicates = 0;  // tensors pointed at a payload written once
+    uint64_t saved = 0;     // bytes not written thanks to them
+    unsigned threads = 0;
+    double elapsed_ms = 0;
+};
+
+class WeightsWriter {
+public:
+    // `location` is what the tensors record, `path` where the file is written.
+    WeightsWriter(std::string path, std::string location, WriterOptions options);
+
+    // Moves the tensor's raw_data into the writer. The tensor must outlive
+    // finish(), which adds its checksum entry.
+    void add(onnx::TensorProto& tensor);
+    // Same, with the XXH64 of the raw_data already computed by the caller.
+    void add(onnx::TensorProto& tensor, uint64_t hash);
+
+    // Declare a payload already in the file (append mode). Tensors added
+    // later with the same content point at it.
+    void reuse(const StoredBlob& blob);
+
+    // Write every queued tensor. Throws std::runtime_error on failure.
+    void finish(WriterStats* stats = nullptr);
+
+    // Every unique payload in the file, reused ones included. Checksums are
+    // only known once finish() returned.
+    std::vector<StoredBlob> blobs() const;
+
+private:
+    static constexpr size_t kNone = static_cast<size_t>(-1);
+
+    struct Content {
+        StoredBlob blob;
+        size_t piece;  // the queued payload, kNone once written or reused
+    };
+
+    struct Piece {
+        std::string payload;
+        uint64_t offset;
+        size_t content;
+    };
+
+    // Index of the content equal to `payload`, or kNone
+    size_t find(const std::string& payload, uint64_t hash) const;
+
+    std::string path_;
+    std::string location_;
+    WriterOptions options_;
+    std::vector<Content> contents_;
+    std::unordered_multimap<uint64_t, size_t> by_hash_;
+    std::vector<Piece> pieces_;
+    std::vector<std::pair<onnx::TensorProto*, size_t>> tensors_;  // tensor, content
+    uint64_t start_ = 0;  // where this writer's output starts (append mode)
+    uint64_t end_ = 0;
+    uint64_t padding_ = 0;
+    size_t duplicates_ = 0;
+    uint64_t saved_ = 0;
+};